@@ -12,24 +12,27 @@
  * returns: -ERRNO if error (returned to user)
  *          0: tell VFS to invalidate dentry
  *          1: dentry is valid
+ *
+ * Works in RCU-walk as well: no references are taken and nothing sleeps.
+ * Our dentry holds a reference to its lower dentry for its whole life,
+ * and after d_release both the lower dentry and our private data are
+ * freed only after an RCU grace period, so a walker that still sees them
+ * can look at them.  The lower ->d_revalidate gets LOOKUP_RCU passed on
+ * and returns -ECHILD itself if it cannot cope.
  */
 static int wrapfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 {
-	struct path lower_path;
+	struct wrapfs_dentry_info *info = READ_ONCE(dentry->d_fsdata);
 	struct dentry *lower_dentry;
-	int err = 1;
-
-	if (flags & LOOKUP_RCU)
-		return -ECHILD;
-
-	wrapfs_get_lower_path(dentry, &lower_path);
-	lower_dentry = lower_path.dentry;
-	if (!(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
-		goto out;
-	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
-out:
-	wrapfs_put_lower_path(dentry, &lower_path);
-	return err;
+
+	lower_dentry = info ? READ_ONCE(info->lower_path.dentry) : NULL;
+	/* only RCU-walk can race with d_release */
+	if (unlikely(!lower_dentry))
+		return (flags & LOOKUP_RCU) ? -ECHILD : 0;
+
+	if (!(READ_ONCE(lower_dentry->d_flags) & DCACHE_OP_REVALIDATE))
+		return 1;
+	return lower_dentry->d_op->d_revalidate(lower_dentry, flags);
 }
 
 static void wrapfs_d_release(struct dentry *dentry)
@@ -44,3 +47,22 @@ const struct dentry_operations wrapfs_dops = {
 	.d_revalidate	= wrapfs_d_revalidate,
 	.d_release	= wrapfs_d_release,
 };
+
+/* for dentries whose lower dentry never needs revalidation */
+const struct dentry_operations wrapfs_noreval_dops = {
+	.d_release	= wrapfs_d_release,
+};
+
+/*
+ * Only give @dentry a ->d_revalidate when its lower dentry has one, so
+ * the VFS does not call into wrapfs at all on path walks over lower file
+ * systems that never revalidate (most local ones).  @lower_dentry is NULL
+ * when there is none, as on a failed lookup.
+ */
+void wrapfs_set_d_op(struct dentry *dentry, struct dentry *lower_dentry)
+{
+	if (lower_dentry && (lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
+		d_set_d_op(dentry, &wrapfs_dops);
+	else
+		d_set_d_op(dentry, &wrapfs_noreval_dops);
+}
@@ -26,6 +26,18 @@ static long wrapfs_unlocked_ioctl(struct file *file, unsigned int cmd,
     long err = -ENOTTY;
     struct file *lower_file;
 
+    /* our own ioctls (wrapfs_ioctl.h) */
+    switch (cmd) {
+    case WRAPFS_IOC_PLAN_START:
+    case WRAPFS_IOC_PLAN_STATUS:
+    case WRAPFS_IOC_PLAN_CANCEL:
+        return wrapfs_plan_ioctl(file, cmd, arg);
+    case WRAPFS_IOC_PIN:
+    case WRAPFS_IOC_UNPIN:
+    case WRAPFS_IOC_PIN_STATUS:
+        return wrapfs_pin_ioctl(file, cmd, arg);
+    }
+
     lower_file = wrapfs_lower_file(file);
 
     /* XXX: use vfs_ioctl if/when VFS exports it */
@@ -47,6 +59,18 @@ static long wrapfs_compat_ioctl(struct file *file, unsigned int cmd,
     long err = -ENOTTY;
     struct file *lower_file;
 
+    /* same layout for 32 and 64 bit callers */
+    switch (cmd) {
+    case WRAPFS_IOC_PLAN_START:
+    case WRAPFS_IOC_PLAN_STATUS:
+    case WRAPFS_IOC_PLAN_CANCEL:
+        return wrapfs_plan_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+    case WRAPFS_IOC_PIN:
+    case WRAPFS_IOC_UNPIN:
+    case WRAPFS_IOC_PIN_STATUS:
+        return wrapfs_pin_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+    }
+
     lower_file = wrapfs_lower_file(file);
 
     /* XXX: use vfs_ioctl if/when VFS exports it */
@@ -60,60 +84,53 @@ out:
 }
 #endif
 
+/*
+ * Map the lower file itself: vma->vm_file becomes the lower file and the
+ * lower ->mmap installs its own vm_ops, so page faults (fault-around, huge
+ * faults and page_mkwrite included) are served by the lower file system
+ * directly and never enter wrapfs.  The vma is also linked into the lower
+ * mapping, so truncation and reclaim of the lower file find our ptes.
+ */
 static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma) {
-    int err = 0;
-    bool willwrite;
+    int err;
     struct file *lower_file;
-    const struct vm_operations_struct *saved_vm_ops = NULL;
 
-    /* this might be deferred to mmap's writepage */
-    willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
+    if (WARN_ON(file != vma->vm_file))
+        return -EIO;
 
-    /*
-     * File systems which do not implement ->writepage may use
-     * generic_file_readonly_mmap as their ->mmap op.  If you call
-     * generic_file_readonly_mmap with VM_WRITE, you'd get an -EINVAL.
-     * But we cannot call the lower ->mmap op, so we can't tell that
-     * writeable mappings won't work.  Therefore, our only choice is to
-     * check if the lower file system supports the ->writepage, and if
-     * not, return EINVAL (the same error that
-     * generic_file_readonly_mmap returns in that case).
-     */
     lower_file = wrapfs_lower_file(file);
-    if (willwrite && !lower_file->f_mapping->a_ops->writepage) {
-        err = -EINVAL;
-        printk(KERN_ERR "wrapfs: lower file system does not "
-                        "support writeable mmap\n");
-        goto out;
-    }
+    if (!lower_file->f_op->mmap)
+        return -ENODEV;
 
     /*
-     * find and save lower vm_ops.
-     *
-     * XXX: the VFS should have a cleaner way of finding the lower vm_ops
+     * No write-behind data can be pending here: mmap needs an FMODE_READ
+     * file, and nothing is buffered while one is open (writebehind.c).
      */
-    if (!WRAPFS_F(file)->lower_vm_ops) {
-        err = lower_file->f_op->mmap(lower_file, vma);
-        if (err) {
-            printk(KERN_ERR "wrapfs: lower mmap failed %d\n", err);
-            goto out;
-        }
-        saved_vm_ops = vma->vm_ops; /* save: came from lower ->mmap */
-    }
+    vma_set_file(vma, lower_file);
+    err = call_mmap(vma->vm_file, vma);
+    if (!err)
+        file_accessed(file);
+    return err;
+}
 
-    /*
-     * Next 3 lines are all I need from generic_file_mmap.  I definitely
-     * don't want its test for ->readpage which returns -ENOEXEC.
-     */
-    file_accessed(file);
-    vma->vm_ops = &wrapfs_vm_ops;
+/*
+ * Pick the mapping address the way the lower file would, so that lower
+ * file systems which align mappings for huge pages (tmpfs huge=, DAX)
+ * still get PMD-aligned addresses through wrapfs.
+ */
+static unsigned long wrapfs_get_unmapped_area(struct file *file,
+                                              unsigned long addr,
+                                              unsigned long len,
+                                              unsigned long pgoff,
+                                              unsigned long flags) {
+    struct file *lower_file;
 
-    file->f_mapping->a_ops = &wrapfs_aops; /* set our aops */
-    if (!WRAPFS_F(file)->lower_vm_ops)     /* save for our ->fault */
-        WRAPFS_F(file)->lower_vm_ops = saved_vm_ops;
+    lower_file = wrapfs_lower_file(file);
+    if (!lower_file->f_op->get_unmapped_area)
+        return current->mm->get_unmapped_area(file, addr, len, pgoff, flags);
 
-out:
-    return err;
+    return lower_file->f_op->get_unmapped_area(lower_file, addr, len, pgoff,
+                                               flags);
 }
 
 static int wrapfs_open(struct inode *inode, struct file *file) {
@@ -136,7 +153,7 @@ static int wrapfs_open(struct inode *inode, struct file *file) {
     /* open lower object and link wrapfs's file struct to lower's */
     wrapfs_get_lower_path(file->f_path.dentry, &lower_path);
     lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
-    path_put(&lower_path);
+    wrapfs_put_lower_path(file->f_path.dentry, &lower_path);
     if (IS_ERR(lower_file)) {
         err = PTR_ERR(lower_file);
         lower_file = wrapfs_lower_file(file);
@@ -146,25 +163,59 @@ static int wrapfs_open(struct inode *inode, struct file *file) {
         }
     } else {
         wrapfs_set_lower_file(file, lower_file);
+        /*
+         * Advertise nonblocking I/O only when the lower file supports it,
+         * so io_uring can issue inline instead of punting to io-wq.  Not
+         * FMODE_BUF_RASYNC, as overlayfs doesn't: an IOCB_WAITQ read that
+         * finds a locked page returns -EIOCBQUEUED without ever calling
+         * ->ki_complete, which wrapfs_aio_rw cannot tell from a queued
+         * request, and the lower iocb clone has no ki_waitq to park on.
+         */
+        file->f_mode |= lower_file->f_mode & FMODE_NOWAIT;
+        /*
+         * Our data is cached in the lower mapping only, so page cache
+         * control that acts on f_mapping (sync_file_range, readahead,
+         * O_DIRECT checks, ...) has to act on the lower mapping too.
+         */
+        if (S_ISREG(inode->i_mode)) {
+            file->f_mapping = lower_file->f_mapping;
+            /* do_dentry_open sampled the upper mapping's errors */
+            file->f_wb_err = filemap_sample_wb_err(file->f_mapping);
+        }
     }
 
-    if (err)
+    if (err) {
         kfree(WRAPFS_F(file));
-    else
-        fsstack_copy_attr_all(inode, wrapfs_lower_inode(inode));
+        goto out_err;
+    }
+
+    fsstack_copy_attr_all(inode, wrapfs_lower_inode(inode));
+    if (S_ISREG(inode->i_mode))
+        wrapfs_wb_open(file);
+    if (S_ISREG(inode->i_mode) && WRAPFS_SB(inode->i_sb)->pf_max)
+        wrapfs_prefetch_open(file);
 out_err:
     return err;
 }
 
+/*
+ * All data pages, including those dirtied through shared mappings, live in
+ * the lower mapping (wrapfs_mmap maps the lower file), so apart from the
+ * write-behind buffer there is nothing of ours to write back: whatever the
+ * lower ->flush does is all there is.
+ */
 static int wrapfs_flush(struct file *file, fl_owner_t id) {
-    int err = 0;
+    int err;
     struct file *lower_file = NULL;
 
+    /* report write-behind errors to close(2), as NFS does */
+    err = wrapfs_wb_drain(file_inode(file));
+    if (err)
+        return err;
+
     lower_file = wrapfs_lower_file(file);
-    if (lower_file && lower_file->f_op && lower_file->f_op->flush) {
-        filemap_write_and_wait(file->f_mapping);
+    if (lower_file && lower_file->f_op && lower_file->f_op->flush)
         err = lower_file->f_op->flush(lower_file, id);
-    }
 
     return err;
 }
@@ -173,8 +224,14 @@ static int wrapfs_flush(struct file *file, fl_owner_t id) {
 static int wrapfs_file_release(struct inode *inode, struct file *file) {
     struct file *lower_file;
 
+    /* a failed flush is recorded on the lower mapping for fsync */
+    wrapfs_wb_drain(inode);
+    wrapfs_refresh_attr(inode);
+    if (S_ISREG(inode->i_mode))
+        wrapfs_wb_release(file);
     lower_file = wrapfs_lower_file(file);
     if (lower_file) {
+        wrapfs_prefetch_release(file);
         wrapfs_set_lower_file(file, NULL);
         fput(lower_file);
     }
@@ -183,22 +240,23 @@ static int wrapfs_file_release(struct inode *inode, struct file *file) {
     return 0;
 }
 
+/*
+ * The upper mapping never holds dirty pages and the upper inode is never
+ * written back on its own, so once the write-behind buffer is drained,
+ * syncing the lower file is all fsync needs; the lower file system
+ * batches the writeback of the whole range.
+ */
 static int wrapfs_fsync(struct file *file, loff_t start, loff_t end,
                         int datasync) {
     int err;
     struct file *lower_file;
-    struct path lower_path;
-    struct dentry *dentry = file->f_path.dentry;
 
-    err = __generic_file_fsync(file, start, end, datasync);
+    err = wrapfs_wb_drain(file_inode(file));
     if (err)
-        goto out;
+        return err;
+    wrapfs_refresh_attr(file_inode(file));
     lower_file = wrapfs_lower_file(file);
-    wrapfs_get_lower_path(dentry, &lower_path);
-    err = vfs_fsync_range(lower_file, start, end, datasync);
-    wrapfs_put_lower_path(dentry, &lower_path);
-out:
-    return err;
+    return vfs_fsync_range(lower_file, start, end, datasync);
 }
 
 static int wrapfs_fasync(int fd, struct file *file, int flag) {
@@ -234,27 +292,230 @@ out:
 }
 
 /*
- * Wrapfs read_iter, redirect modified iocb to lower read_iter
+ * Wrapfs llseek for regular files.  Plain seeks only move the upper
+ * offset, but SEEK_DATA/SEEK_HOLE need to look at the lower file's
+ * extents, which only the lower file system knows about.
+ */
+static loff_t wrapfs_main_llseek(struct file *file, loff_t offset,
+                                 int whence) {
+    loff_t err;
+    struct file *lower_file;
+
+    if (whence == SEEK_END || whence == SEEK_DATA || whence == SEEK_HOLE) {
+        err = wrapfs_wb_sync(file_inode(file), false);
+        if (err)
+            goto out;
+    }
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        if (whence == SEEK_END)
+            wrapfs_refresh_attr(file_inode(file));
+        return generic_file_llseek(file, offset, whence);
+    }
+
+    lower_file = wrapfs_lower_file(file);
+    err = vfs_llseek(lower_file, offset, whence);
+    if (err < 0)
+        goto out;
+
+    err = vfs_setpos(file, err, file_inode(file)->i_sb->s_maxbytes);
+out:
+    return err;
+}
+
+/*
+ * Per-request state for asynchronous I/O.  The lower file system gets a
+ * private clone of the caller's iocb which points at the lower file, so
+ * the caller's iocb is never modified, and the upper attributes are only
+ * copied once the lower request has really finished.
+ *
+ * The cache is SLAB_TYPESAFE_BY_RCU so that wrapfs_iopoll can safely race
+ * with the completion freeing the request it is polling.
+ *
+ * No reference is taken on the lower file: the caller holds the upper
+ * file until its ->ki_complete has run, and the upper file pins the lower
+ * one until wrapfs_file_release.
+ */
+struct wrapfs_aio_req {
+    struct kiocb iocb;
+    refcount_t ref;
+    struct kiocb *orig_iocb;
+};
+
+static struct kmem_cache *wrapfs_aio_req_cachep;
+
+static void wrapfs_aio_put(struct wrapfs_aio_req *aio_req) {
+    if (refcount_dec_and_test(&aio_req->ref))
+        kmem_cache_free(wrapfs_aio_req_cachep, aio_req);
+}
+
+/* the lower request is done: update the upper iocb and inode */
+static void wrapfs_aio_cleanup(struct wrapfs_aio_req *aio_req) {
+    struct kiocb *iocb = &aio_req->iocb;
+    struct kiocb *orig_iocb = aio_req->orig_iocb;
+    struct inode *inode = file_inode(orig_iocb->ki_filp);
+    struct inode *lower_inode = file_inode(iocb->ki_filp);
+
+    if (iocb->ki_flags & IOCB_WRITE) {
+        /* taken in wrapfs_aio_rw, same trick as aio_complete_rw() */
+        __sb_writers_acquired(lower_inode->i_sb, SB_FREEZE_WRITE);
+        file_end_write(iocb->ki_filp);
+        wrapfs_copy_attr_write(inode, lower_inode);
+    } else {
+        wrapfs_copy_attr_read(inode, lower_inode);
+    }
+    orig_iocb->ki_pos = iocb->ki_pos;
+    wrapfs_aio_put(aio_req);
+}
+
+static void wrapfs_aio_complete(struct kiocb *iocb, long res, long res2) {
+    struct wrapfs_aio_req *aio_req =
+        container_of(iocb, struct wrapfs_aio_req, iocb);
+    struct kiocb *orig_iocb = aio_req->orig_iocb;
+
+    wrapfs_aio_cleanup(aio_req);
+    orig_iocb->ki_complete(orig_iocb, res, res2);
+}
+
+/*
+ * Submit an asynchronous read or write to the lower file through a
+ * wrapfs_aio_req.  One reference belongs to the submitter and one to the
+ * completion; whoever drops the last one frees the request.
+ */
+static ssize_t wrapfs_aio_rw(struct kiocb *iocb, struct iov_iter *iter,
+                             struct file *lower_file, int rw) {
+    ssize_t err;
+    struct wrapfs_aio_req *aio_req;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+
+    aio_req = kmem_cache_zalloc(wrapfs_aio_req_cachep,
+                                nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!aio_req)
+        return nowait ? -EAGAIN : -ENOMEM;
+
+    kiocb_clone(&aio_req->iocb, iocb, lower_file);
+    aio_req->iocb.ki_complete = wrapfs_aio_complete;
+    if (rw == WRITE) {
+        aio_req->iocb.ki_flags |= IOCB_WRITE;
+        /*
+         * Hold off freezing of the lower file system until the write
+         * completed; the completion may run in another context, so hand
+         * the lock over to it as aio_write() does.
+         */
+        file_start_write(lower_file);
+        __sb_writers_release(file_inode(lower_file)->i_sb, SB_FREEZE_WRITE);
+    }
+    aio_req->orig_iocb = iocb;
+    /* publish orig_iocb before a racing wrapfs_iopoll can take a ref */
+    smp_wmb();
+    refcount_set(&aio_req->ref, 2);
+    if (iocb->ki_flags & IOCB_HIPRI)
+        WRITE_ONCE(iocb->private, aio_req);
+
+    if (rw == READ)
+        err = lower_file->f_op->read_iter(&aio_req->iocb, iter);
+    else
+        err = lower_file->f_op->write_iter(&aio_req->iocb, iter);
+
+    /* completed (or failed) inline: ->ki_complete will not be called */
+    if (err != -EIOCBQUEUED)
+        wrapfs_aio_cleanup(aio_req);
+    wrapfs_aio_put(aio_req);
+    return err;
+}
+
+int wrapfs_init_aio_cache(void) {
+    wrapfs_aio_req_cachep =
+        kmem_cache_create("wrapfs_aio_req", sizeof(struct wrapfs_aio_req), 0,
+                          SLAB_TYPESAFE_BY_RCU, NULL);
+
+    return wrapfs_aio_req_cachep ? 0 : -ENOMEM;
+}
+
+void wrapfs_destroy_aio_cache(void) {
+    if (wrapfs_aio_req_cachep)
+        kmem_cache_destroy(wrapfs_aio_req_cachep);
+}
+
+/*
+ * O_DIRECT requests go straight to the lower file, which must support
+ * direct I/O itself (the VFS checks f_mapping, which wrapfs_open points at
+ * the lower mapping, but be defensive on the I/O path as well).
+ * When the lower file system sits on a single block device, reject
+ * misaligned requests here instead of taking the lower locks first.
+ */
+static int wrapfs_check_direct_IO(struct file *lower_file, struct kiocb *iocb,
+                                  struct iov_iter *iter) {
+    struct address_space *lower_mapping = lower_file->f_mapping;
+    struct block_device *bdev = file_inode(lower_file)->i_sb->s_bdev;
+    unsigned int blkmask;
+
+    if (!lower_mapping->a_ops || !lower_mapping->a_ops->direct_IO)
+        return -EINVAL;
+    if (!bdev)
+        return 0;
+
+    blkmask = bdev_logical_block_size(bdev) - 1;
+    if ((iocb->ki_pos | iov_iter_alignment(iter)) & blkmask)
+        return -EINVAL;
+    return 0;
+}
+
+/*
+ * Wrapfs read_iter, redirect modified iocb to lower read_iter.  The lower
+ * file lives as long as the upper one, which the caller holds for the
+ * whole call, so there is no need to get_file/fput it per request.
  */
 ssize_t wrapfs_read_iter(struct kiocb *iocb, struct iov_iter *iter) {
-    int err;
+    ssize_t err;
     struct file *file = iocb->ki_filp, *lower_file;
+    loff_t pos;
+    u64 ra_start;
 
     lower_file = wrapfs_lower_file(file);
     if (!lower_file->f_op->read_iter) {
         err = -EINVAL;
         goto out;
     }
+    /* a nonblocking request must not end up blocking in the lower fs */
+    if ((iocb->ki_flags & IOCB_NOWAIT) &&
+        !(lower_file->f_mode & FMODE_NOWAIT)) {
+        err = -EAGAIN;
+        goto out;
+    }
+
+    err = wrapfs_wb_sync(file_inode(file), iocb->ki_flags & IOCB_NOWAIT);
+    if (err)
+        goto out;
+
+    if (iocb->ki_flags & IOCB_DIRECT) {
+        err = wrapfs_check_direct_IO(lower_file, iocb, iter);
+        if (err)
+            goto out;
+    }
+
+    pos = iocb->ki_pos;
+    wrapfs_prefetch_begin(file, pos);
+    if (!is_sync_kiocb(iocb)) {
+        /* as far as prefetch accounting goes, submitted means read */
+        wrapfs_prefetch_end(file, pos + iov_iter_count(iter));
+        err = wrapfs_aio_rw(iocb, iter, lower_file, READ);
+        goto out;
+    }
 
-    get_file(lower_file); /* prevent lower_file from being released */
+    ra_start = wrapfs_ra_begin(iocb);
     iocb->ki_filp = lower_file;
     err = lower_file->f_op->read_iter(iocb, iter);
     iocb->ki_filp = file;
-    fput(lower_file);
+    if (err > 0) {
+        wrapfs_prefetch_end(file, pos + err);
+        if (ra_start)
+            wrapfs_ra_done(file, pos, err, ra_start);
+    }
     /* update upper inode atime as needed */
-    if (err >= 0 || err == -EIOCBQUEUED)
-        fsstack_copy_attr_atime(d_inode(file->f_path.dentry),
-                                file_inode(lower_file));
+    if (err >= 0)
+        wrapfs_copy_attr_read(d_inode(file->f_path.dentry),
+                              file_inode(lower_file));
 out:
     return err;
 }
@@ -263,7 +524,7 @@ out:
  * Wrapfs write_iter, redirect modified iocb to lower write_iter
  */
 ssize_t wrapfs_write_iter(struct kiocb *iocb, struct iov_iter *iter) {
-    int err;
+    ssize_t err;
     struct file *file = iocb->ki_filp, *lower_file;
 
     lower_file = wrapfs_lower_file(file);
@@ -271,30 +532,272 @@ ssize_t wrapfs_write_iter(struct kiocb *iocb, struct iov_iter *iter) {
         err = -EINVAL;
         goto out;
     }
+    /* a nonblocking request must not end up blocking in the lower fs */
+    if ((iocb->ki_flags & IOCB_NOWAIT) &&
+        !(lower_file->f_mode & FMODE_NOWAIT)) {
+        err = -EAGAIN;
+        goto out;
+    }
+
+    /* absorb small sequential writes, flush the buffer before any other */
+    if (WRAPFS_SB(file_inode(file)->i_sb)->wb_max) {
+        err = wrapfs_wb_write(iocb, iter);
+        if (err)
+            goto out;
+    }
+
+    if (iocb->ki_flags & IOCB_DIRECT) {
+        err = wrapfs_check_direct_IO(lower_file, iocb, iter);
+        if (err)
+            goto out;
+    }
+
+    if (!is_sync_kiocb(iocb)) {
+        err = wrapfs_aio_rw(iocb, iter, lower_file, WRITE);
+        goto out;
+    }
 
-    get_file(lower_file); /* prevent lower_file from being released */
     iocb->ki_filp = lower_file;
+    file_start_write(lower_file);
     err = lower_file->f_op->write_iter(iocb, iter);
+    file_end_write(lower_file);
     iocb->ki_filp = file;
-    fput(lower_file);
     /* update upper inode times/sizes as needed */
-    if (err >= 0 || err == -EIOCBQUEUED) {
+    if (err >= 0)
+        wrapfs_copy_attr_write(d_inode(file->f_path.dentry),
+                               file_inode(lower_file));
+out:
+    return err;
+}
+
+/*
+ * Wrapfs iopoll, poll for completion of IOCB_HIPRI requests which were
+ * submitted to the lower file.  ->private of the upper iocb points at the
+ * wrapfs_aio_req, which may be completed and freed under us; take a
+ * reference first and make sure it still belongs to this iocb.
+ */
+static int wrapfs_iopoll(struct kiocb *iocb, bool spin) {
+    int err = 0;
+    struct file *lower_file;
+    struct wrapfs_aio_req *aio_req;
+
+    rcu_read_lock();
+    aio_req = READ_ONCE(iocb->private);
+    if (aio_req && !refcount_inc_not_zero(&aio_req->ref))
+        aio_req = NULL;
+    rcu_read_unlock();
+    if (!aio_req)
+        goto out;
+
+    smp_rmb(); /* pairs with smp_wmb() in wrapfs_aio_rw */
+    lower_file = aio_req->iocb.ki_filp;
+    if (aio_req->orig_iocb == iocb && lower_file->f_op->iopoll)
+        err = lower_file->f_op->iopoll(&aio_req->iocb, spin);
+    wrapfs_aio_put(aio_req);
+out:
+    return err;
+}
+
+/*
+ * Wrapfs splice_read, hand the pipe straight to the lower splice_read so
+ * that sendfile/splice keep the lower file system's zero-copy path
+ */
+static ssize_t wrapfs_splice_read(struct file *file, loff_t *ppos,
+                                  struct pipe_inode_info *pipe, size_t len,
+                                  unsigned int flags) {
+    ssize_t err;
+    struct file *lower_file;
+    loff_t pos;
+
+    lower_file = wrapfs_lower_file(file);
+    if (!lower_file->f_op->splice_read) {
+        err = -EINVAL;
+        goto out;
+    }
+
+    err = wrapfs_wb_sync(file_inode(file), false);
+    if (err)
+        goto out;
+
+    pos = *ppos;
+    wrapfs_prefetch_begin(file, pos);
+    err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len, flags);
+    if (err > 0)
+        wrapfs_prefetch_end(file, pos + err);
+    /* update upper inode atime as needed */
+    if (err >= 0)
+        wrapfs_copy_attr_read(d_inode(file->f_path.dentry),
+                              file_inode(lower_file));
+out:
+    return err;
+}
+
+/*
+ * Wrapfs splice_write, hand the pipe straight to the lower splice_write
+ */
+static ssize_t wrapfs_splice_write(struct pipe_inode_info *pipe,
+                                   struct file *file, loff_t *ppos, size_t len,
+                                   unsigned int flags) {
+    ssize_t err;
+    struct file *lower_file;
+
+    lower_file = wrapfs_lower_file(file);
+    if (!lower_file->f_op->splice_write) {
+        err = -EINVAL;
+        goto out;
+    }
+
+    err = wrapfs_wb_sync(file_inode(file), false);
+    if (err)
+        goto out;
+
+    file_start_write(lower_file);
+    err = lower_file->f_op->splice_write(pipe, lower_file, ppos, len, flags);
+    file_end_write(lower_file);
+    /* update upper inode times/sizes as needed */
+    if (err > 0)
+        wrapfs_copy_attr_write(d_inode(file->f_path.dentry),
+                               file_inode(lower_file));
+out:
+    return err;
+}
+
+/*
+ * Wrapfs fadvise (and readahead(2), which is built on it): WILLNEED and
+ * DONTNEED have to act on the lower page cache, and SEQUENTIAL/RANDOM
+ * on the lower file's readahead state, since that is the file our reads
+ * are issued on.
+ */
+static int wrapfs_fadvise(struct file *file, loff_t offset, loff_t len,
+                          int advice) {
+    struct file *lower_file;
+
+    lower_file = wrapfs_lower_file(file);
+    return vfs_fadvise(lower_file, offset, len, advice);
+}
+
+/*
+ * Wrapfs fallocate, forward every mode (preallocate, punch-hole,
+ * zero-range, collapse/insert-range, ...) to the lower file
+ */
+static long wrapfs_fallocate(struct file *file, int mode, loff_t offset,
+                             loff_t len) {
+    long err;
+    struct file *lower_file;
+
+    err = wrapfs_wb_sync(file_inode(file), false);
+    if (err)
+        return err;
+
+    lower_file = wrapfs_lower_file(file);
+    err = vfs_fallocate(lower_file, mode, offset, len);
+    /* update upper inode size/blocks and times as needed */
+    if (!err) {
+        wrapfs_pin_note_change(file_inode(file), file_inode(lower_file));
         fsstack_copy_inode_size(d_inode(file->f_path.dentry),
                                 file_inode(lower_file));
         fsstack_copy_attr_times(d_inode(file->f_path.dentry),
                                 file_inode(lower_file));
     }
+
+    return err;
+}
+
+enum wrapfs_copyop {
+    WRAPFS_COPY,
+    WRAPFS_CLONE,
+    WRAPFS_DEDUPE,
+};
+
+/*
+ * Common body of ->copy_file_range and ->remap_file_range: map both upper
+ * files onto their lower files and let the lower file system do the copy,
+ * clone or dedupe.  The VFS helpers used here redo all range, permission
+ * and same-sb checks against the lower files.
+ */
+static loff_t wrapfs_copyfile(struct file *file_in, loff_t pos_in,
+                              struct file *file_out, loff_t pos_out,
+                              loff_t len, unsigned int flags,
+                              enum wrapfs_copyop op) {
+    loff_t err;
+    struct inode *inode_out = file_inode(file_out);
+    struct file *lower_file_in, *lower_file_out;
+
+    /* both files have to live on the same wrapfs mount */
+    if (file_inode(file_in)->i_sb != inode_out->i_sb) {
+        err = -EXDEV;
+        goto out;
+    }
+
+    err = wrapfs_wb_sync(file_inode(file_in), false);
+    if (!err)
+        err = wrapfs_wb_sync(inode_out, false);
+    if (err)
+        goto out;
+
+    lower_file_in = wrapfs_lower_file(file_in);
+    lower_file_out = wrapfs_lower_file(file_out);
+
+    switch (op) {
+    case WRAPFS_COPY:
+        err = vfs_copy_file_range(lower_file_in, pos_in, lower_file_out,
+                                  pos_out, len, flags);
+        break;
+    case WRAPFS_CLONE:
+        err = vfs_clone_file_range(lower_file_in, pos_in, lower_file_out,
+                                   pos_out, len, flags);
+        break;
+    case WRAPFS_DEDUPE:
+        err = vfs_dedupe_file_range_one(lower_file_in, pos_in, lower_file_out,
+                                        pos_out, len, flags);
+        break;
+    default:
+        err = -EINVAL;
+        break;
+    }
+
+    /* update upper inode times/sizes as needed */
+    if (err > 0) {
+        wrapfs_pin_note_change(inode_out, file_inode(lower_file_out));
+        fsstack_copy_inode_size(inode_out, file_inode(lower_file_out));
+        fsstack_copy_attr_times(inode_out, file_inode(lower_file_out));
+    }
 out:
     return err;
 }
 
+static ssize_t wrapfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                                      struct file *file_out, loff_t pos_out,
+                                      size_t len, unsigned int flags) {
+    return wrapfs_copyfile(file_in, pos_in, file_out, pos_out, len, flags,
+                           WRAPFS_COPY);
+}
+
+static loff_t wrapfs_remap_file_range(struct file *file_in, loff_t pos_in,
+                                      struct file *file_out, loff_t pos_out,
+                                      loff_t len, unsigned int remap_flags) {
+    enum wrapfs_copyop op;
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+
+    if (remap_flags & REMAP_FILE_DEDUP)
+        op = WRAPFS_DEDUPE;
+    else
+        op = WRAPFS_CLONE;
+
+    return wrapfs_copyfile(file_in, pos_in, file_out, pos_out, len,
+                           remap_flags, op);
+}
+
 const struct file_operations wrapfs_main_fops = {
-    .llseek = generic_file_llseek,
+    .llseek = wrapfs_main_llseek,
     .unlocked_ioctl = wrapfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
     .compat_ioctl = wrapfs_compat_ioctl,
 #endif
     .mmap = wrapfs_mmap,
+    .get_unmapped_area = wrapfs_get_unmapped_area,
     .open = wrapfs_open,
     .flush = wrapfs_flush,
     .release = wrapfs_file_release,
@@ -302,6 +805,13 @@ const struct file_operations wrapfs_main_fops = {
     .fasync = wrapfs_fasync,
     .read_iter = wrapfs_read_iter,
     .write_iter = wrapfs_write_iter,
+    .iopoll = wrapfs_iopoll,
+    .splice_read = wrapfs_splice_read,
+    .splice_write = wrapfs_splice_write,
+    .copy_file_range = wrapfs_copy_file_range,
+    .remap_file_range = wrapfs_remap_file_range,
+    .fallocate = wrapfs_fallocate,
+    .fadvise = wrapfs_fadvise,
 };
 
 /* trimmed directory options */
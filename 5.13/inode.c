@@ -104,6 +104,9 @@ static int wrapfs_unlink(struct inode *dir, struct dentry *dentry) {
     fsstack_copy_attr_times(dir, lower_dir_inode);
     fsstack_copy_inode_size(dir, lower_dir_inode);
     set_nlink(d_inode(dentry), wrapfs_lower_inode(d_inode(dentry))->i_nlink);
+    /* a pinned file that is gone has to leave the pin set */
+    wrapfs_pin_note_change(d_inode(dentry),
+                           wrapfs_lower_inode(d_inode(dentry)));
     d_inode(dentry)->i_ctime = dir->i_ctime;
     d_drop(dentry); /* this is needed, else LTP fails (VFS won't do it) */
 out:
@@ -288,6 +291,10 @@ static int wrapfs_rename(struct user_namespace *mnt_userns,
     err = vfs_rename(&rd);
     if (err)
         goto out;
+    /* a replaced target may have been pinned */
+    if (d_really_is_positive(new_dentry))
+        wrapfs_pin_note_change(d_inode(new_dentry),
+                               wrapfs_lower_inode(d_inode(new_dentry)));
 
     fsstack_copy_attr_all(new_dir, d_inode(lower_new_dir_dentry));
     fsstack_copy_inode_size(new_dir, d_inode(lower_new_dir_dentry));
@@ -305,47 +312,126 @@ out:
     return err;
 }
 
+void wrapfs_put_link(void *arg) {
+    struct wrapfs_link *link = arg;
+
+    if (refcount_dec_and_test(&link->ref))
+        kfree_rcu(link, rcu);
+}
+
+/* the cached body, if it is still current; called under rcu_read_lock */
+static struct wrapfs_link *wrapfs_cached_link(struct wrapfs_inode_info *info,
+                                              struct inode *lower_inode) {
+    struct wrapfs_link *link;
+    unsigned int seq;
+    bool fresh;
+
+    if (!lower_inode)
+        return NULL;
+    do {
+        seq = read_seqcount_begin(&info->link_seq);
+        link = rcu_dereference(info->link);
+        fresh = link && timespec64_equal(&info->link_ctime,
+                                         &lower_inode->i_ctime);
+    } while (read_seqcount_retry(&info->link_seq, seq));
+    return fresh ? link : NULL;
+}
+
+/*
+ * The symlink body is cached in the upper inode and handed out directly,
+ * without allocating or calling into the lower file system, also in
+ * RCU-walk (dentry == NULL).  Callers get a reference, dropped by @done,
+ * in RCU-walk too: the walk may drop out of RCU mode (try_to_unlazy)
+ * while still parsing the body, and the VFS runs @done either way.  The
+ * body is read again once the lower inode's ctime moved, which any change to
+ * the lower symlink bumps; when the target is still the same, as after a
+ * chown or touch -h, only the ctime stamp is updated.
+ */
 static const char *wrapfs_get_link(struct dentry *dentry, struct inode *inode,
                                    struct delayed_call *done) {
     DEFINE_DELAYED_CALL(lower_done);
+    struct wrapfs_inode_info *info = WRAPFS_I(inode);
+    struct inode *lower_inode = READ_ONCE(info->lower_inode);
+    struct wrapfs_link *link, *old;
     struct dentry *lower_dentry;
     struct path lower_path;
-    char *buf;
+    struct timespec64 ctime;
     const char *lower_link;
-
+    size_t len;
+
+    rcu_read_lock();
+    link = wrapfs_cached_link(info, lower_inode);
+    if (link && !refcount_inc_not_zero(&link->ref))
+        link = NULL;
+    rcu_read_unlock();
+    if (link) {
+        set_delayed_call(done, wrapfs_put_link, link);
+        return link->body;
+    }
     if (!dentry)
         return ERR_PTR(-ECHILD);
 
     wrapfs_get_lower_path(dentry, &lower_path);
     lower_dentry = lower_path.dentry;
 
+    /* a change racing with the read below makes the next call read again */
+    ctime = lower_inode->i_ctime;
     /*
      * get link from lower file system, but use a separate
      * delayed_call callback.
      */
     lower_link = vfs_get_link(lower_dentry, &lower_done);
-    if (IS_ERR(lower_link)) {
-        buf = ERR_CAST(lower_link);
-        goto out;
+    if (IS_ERR(lower_link))
+        goto out;
+
+    /* same target as cached: just move the stamp forward */
+    spin_lock(&inode->i_lock);
+    link = rcu_dereference_protected(info->link,
+                                     lockdep_is_held(&inode->i_lock));
+    if (link && !strcmp(link->body, lower_link)) {
+        write_seqcount_begin(&info->link_seq);
+        info->link_ctime = ctime;
+        write_seqcount_end(&info->link_seq);
+        refcount_inc(&link->ref);
+        spin_unlock(&inode->i_lock);
+        do_delayed_call(&lower_done);
+        goto out_link;
     }
+    spin_unlock(&inode->i_lock);
 
     /*
      * we can't pass lower link up: have to make private copy and
-     * pass that.
+     * keep that.
      */
-    buf = kstrdup(lower_link, GFP_KERNEL);
-    do_delayed_call(&lower_done);
-    if (!buf) {
-        buf = ERR_PTR(-ENOMEM);
+    len = strlen(lower_link);
+    link = kmalloc(struct_size(link, body, len + 1), GFP_KERNEL);
+    if (!link) {
+        do_delayed_call(&lower_done);
+        lower_link = ERR_PTR(-ENOMEM);
         goto out;
     }
+    refcount_set(&link->ref, 2); /* the inode's and our caller's */
+    memcpy(link->body, lower_link, len + 1);
+    do_delayed_call(&lower_done);
 
+    spin_lock(&inode->i_lock);
+    old = rcu_dereference_protected(info->link,
+                                    lockdep_is_held(&inode->i_lock));
+    write_seqcount_begin(&info->link_seq);
+    rcu_assign_pointer(info->link, link);
+    info->link_ctime = ctime;
+    write_seqcount_end(&info->link_seq);
+    spin_unlock(&inode->i_lock);
+    if (old)
+        wrapfs_put_link(old);
+
+out_link:
+    set_delayed_call(done, wrapfs_put_link, link);
     fsstack_copy_attr_atime(d_inode(dentry), d_inode(lower_dentry));
-
-    set_delayed_call(done, kfree_link, buf);
+    lower_link = link->body;
 out:
     wrapfs_put_lower_path(dentry, &lower_path);
-    return buf;
+    return lower_link;
 }
 
 static int wrapfs_permission(struct user_namespace *mnt_userns,
@@ -353,7 +439,14 @@ static int wrapfs_permission(struct user_namespace *mnt_userns,
     struct inode *lower_inode;
     int err;
 
-    lower_inode = wrapfs_lower_inode(inode);
+    /*
+     * Called in RCU-walk (MAY_NOT_BLOCK) too, which can race with
+     * eviction dropping the lower inode; both inodes are RCU-freed, and
+     * the lower inode_permission handles MAY_NOT_BLOCK by itself.
+     */
+    lower_inode = READ_ONCE(WRAPFS_I(inode)->lower_inode);
+    if (unlikely(!lower_inode))
+        return -ECHILD;
     err = inode_permission(&init_user_ns, lower_inode, mask);
     return err;
 }
@@ -368,6 +461,11 @@ static int wrapfs_setattr(struct user_namespace *mnt_userns,
     struct iattr lower_ia;
 
     inode = d_inode(dentry);
+    /* truncation and the size we report must include buffered writes */
+    err = wrapfs_wb_sync(inode, false);
+    if (err)
+        goto out_err;
+    wrapfs_refresh_attr(inode);
 
     /*
      * Check if user has permission to change inode.  We don't check if
@@ -423,6 +521,8 @@ static int wrapfs_setattr(struct user_namespace *mnt_userns,
 
     /* get attributes from the lower inode */
     fsstack_copy_attr_all(inode, lower_inode);
+    if (ia->ia_valid & ATTR_SIZE)
+        wrapfs_pin_note_change(inode, lower_inode);
     /*
      * Not running fsstack_copy_inode_size(inode, lower_inode), because
      * VFS should update our inode size, and notify_change on
@@ -443,18 +543,46 @@ static int wrapfs_getattr(struct user_namespace *mnt_userns,
     struct kstat lower_stat;
     struct path lower_path;
 
+    err = wrapfs_wb_sync(d_inode(dentry), false);
+    if (err)
+        return err;
+
     wrapfs_get_lower_path(dentry, &lower_path);
     err = vfs_getattr(&lower_path, &lower_stat, request_mask, flags);
     if (err)
         goto out;
+    wrapfs_refresh_attr(d_inode(dentry));
     fsstack_copy_attr_all(d_inode(dentry), d_inode(lower_path.dentry));
     generic_fillattr(&init_user_ns, d_inode(dentry), stat);
     stat->blocks = lower_stat.blocks;
+    /* preferred I/O size (and O_DIRECT granularity) is the lower one */
+    stat->blksize = lower_stat.blksize;
 out:
     wrapfs_put_lower_path(dentry, &lower_path);
     return err;
 }
 
+/*
+ * Report the lower file's extent map; the lower ->fiemap does its own
+ * fiemap_prep() checks on the user supplied request.
+ */
+static int wrapfs_fiemap(struct inode *inode,
+                         struct fiemap_extent_info *fieinfo, u64 start,
+                         u64 len) {
+    int err;
+    struct inode *lower_inode = wrapfs_lower_inode(inode);
+
+    if (!lower_inode->i_op->fiemap)
+        return -EOPNOTSUPP;
+
+    /* buffered writes have no extents until they reach the lower file */
+    err = wrapfs_wb_sync(inode, false);
+    if (err)
+        return err;
+
+    return lower_inode->i_op->fiemap(lower_inode, fieinfo, start, len);
+}
+
 static int wrapfs_setxattr(struct dentry *dentry, struct inode *inode,
                            const char *name, const void *value, size_t size,
                            int flags) {
@@ -573,6 +701,7 @@ const struct inode_operations wrapfs_main_iops = {
     .setattr = wrapfs_setattr,
     .getattr = wrapfs_getattr,
     .listxattr = wrapfs_listxattr,
+    .fiemap = wrapfs_fiemap,
 };
 
 static int wrapfs_xattr_get(const struct xattr_handler *handler,
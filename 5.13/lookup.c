@@ -8,31 +8,48 @@
 
 #include "wrapfs.h"
 
-/* The dentry cache is just so we have properly sized dentries */
+/*
+ * The dentry cache is just so we have properly sized dentries.  Objects
+ * are cacheline aligned: the read-mostly lower_path of one dentry must
+ * not share a line with another dentry's info being set up or freed.
+ */
 static struct kmem_cache *wrapfs_dentry_cachep;
 
 int wrapfs_init_dentry_cache(void)
 {
 	wrapfs_dentry_cachep =
 		kmem_cache_create("wrapfs_dentry",
-				  sizeof(struct wrapfs_dentry_info),
-				  0, SLAB_RECLAIM_ACCOUNT, NULL);
+				  sizeof(struct wrapfs_dentry_info), 0,
+				  SLAB_RECLAIM_ACCOUNT | SLAB_HWCACHE_ALIGN,
+				  NULL);
 
 	return wrapfs_dentry_cachep ? 0 : -ENOMEM;
 }
 
 void wrapfs_destroy_dentry_cache(void)
 {
+	/* wait for wrapfs_free_dentry_info callbacks still in flight */
+	rcu_barrier();
 	if (wrapfs_dentry_cachep)
 		kmem_cache_destroy(wrapfs_dentry_cachep);
 }
 
+static void wrapfs_free_dentry_info(struct rcu_head *head)
+{
+	kmem_cache_free(wrapfs_dentry_cachep,
+			container_of(head, struct wrapfs_dentry_info, rcu));
+}
+
 void free_dentry_private_data(struct dentry *dentry)
 {
+	struct wrapfs_dentry_info *info;
+
 	if (!dentry || !dentry->d_fsdata)
 		return;
-	kmem_cache_free(wrapfs_dentry_cachep, dentry->d_fsdata);
-	dentry->d_fsdata = NULL;
+	info = dentry->d_fsdata;
+	WRITE_ONCE(dentry->d_fsdata, NULL);
+	/* wrapfs_d_revalidate in RCU-walk may still be looking at it */
+	call_rcu(&info->rcu, wrapfs_free_dentry_info);
 }
 
 /* allocate new dentry private data */
@@ -46,6 +63,7 @@ int new_dentry_private_data(struct dentry *dentry)
 		return -ENOMEM;
 
 	spin_lock_init(&info->lock);
+	seqcount_spinlock_init(&info->seq, &info->lock);
 	dentry->d_fsdata = info;
 
 	return 0;
@@ -60,41 +78,70 @@ static int wrapfs_inode_test(struct inode *inode, void *candidate_lower_inode)
 		return 0; /* no match */
 }
 
+/*
+ * Called under inode_hash_lock before the new inode is hashed, so that a
+ * racing wrapfs_iget of the same lower inode finds it instead of adding
+ * a second one.
+ */
 static int wrapfs_inode_set(struct inode *inode, void *lower_inode)
 {
-	/* we do actual inode initialization in wrapfs_iget */
+	wrapfs_set_lower_inode(inode, lower_inode);
+	/* we do the rest of the inode initialization in wrapfs_iget */
 	return 0;
 }
 
+/*
+ * Find the cached upper inode of @lower_inode without inode_hash_lock.
+ * Only the per-inode i_lock in igrab is taken.  Inodes that are still
+ * being set up are left to iget5_locked, which waits for them.
+ */
+static struct inode *wrapfs_iget_rcu(struct super_block *sb,
+				     struct inode *lower_inode)
+{
+	struct inode *inode;
+
+	rcu_read_lock();
+	inode = find_inode_rcu(sb, (unsigned long)lower_inode,
+			       wrapfs_inode_test, lower_inode);
+	if (inode && !igrab(inode))
+		inode = NULL;
+	rcu_read_unlock();
+
+	if (inode && (READ_ONCE(inode->i_state) & I_NEW)) {
+		iput(inode);
+		inode = NULL;
+	}
+	return inode;
+}
+
+/*
+ * Upper inodes are hashed on the address of their lower inode.  It is
+ * unique for as long as the upper inode holds its reference to the lower
+ * one, so unlike lower inode numbers it never collides, and the hash
+ * chains stay short.  The caller holds a reference to @lower_inode.
+ */
 struct inode *wrapfs_iget(struct super_block *sb, struct inode *lower_inode)
 {
 	struct inode *inode; /* the new inode to return */
 
-	if (!igrab(lower_inode))
-		return ERR_PTR(-ESTALE);
+	inode = wrapfs_iget_rcu(sb, lower_inode);
+	if (inode)
+		return inode;
+
 	inode = iget5_locked(sb, /* our superblock */
-			     /*
-			      * hashval: we use inode number, but we can
-			      * also use "(unsigned long)lower_inode"
-			      * instead.
-			      */
-			     lower_inode->i_ino, /* hashval */
+			     (unsigned long)lower_inode, /* hashval */
 			     wrapfs_inode_test,	/* inode comparison function */
 			     wrapfs_inode_set, /* inode init function */
 			     lower_inode); /* data passed to test+set fxns */
-	if (!inode) {
-		iput(lower_inode);
+	if (!inode)
 		return ERR_PTR(-ENOMEM);
-	}
-	/* if found a cached inode, then just return it (after iput) */
-	if (!(inode->i_state & I_NEW)) {
-		iput(lower_inode);
+	/* if found a cached inode, then just return it */
+	if (!(inode->i_state & I_NEW))
 		return inode;
-	}
 
-	/* initialize new inode */
+	/* initialize new inode, which keeps a reference to the lower one */
+	ihold(lower_inode);
 	inode->i_ino = lower_inode->i_ino;
-	wrapfs_set_lower_inode(inode, lower_inode);
 
 	atomic64_inc(&inode->i_version);
 
@@ -211,11 +258,10 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry,
 	struct qstr this;
 	struct dentry *ret_dentry = NULL;
 
-	/* must initialize dentry operations */
-	d_set_d_op(dentry, &wrapfs_dops);
-
-	if (IS_ROOT(dentry))
+	if (IS_ROOT(dentry)) {
+		wrapfs_set_d_op(dentry, NULL);
 		goto out;
+	}
 
 	name = dentry->d_name.name;
 
@@ -229,6 +275,8 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry,
 
 	/* no error: handle positive dentries */
 	if (!err) {
+		/* must initialize dentry operations, ->d_release in any case */
+		wrapfs_set_d_op(dentry, lower_path.dentry);
 		wrapfs_set_lower_path(dentry, &lower_path);
 		ret_dentry =
 			__wrapfs_interpose(dentry, dentry->d_sb, &lower_path);
@@ -244,8 +292,10 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry,
 	 * We don't consider ENOENT an error, and we want to return a
 	 * negative dentry.
 	 */
-	if (err && err != -ENOENT)
+	if (err && err != -ENOENT) {
+		wrapfs_set_d_op(dentry, NULL);
 		goto out;
+	}
 
 	/* instantiate a new negative dentry */
 	this.name = name;
@@ -257,12 +307,15 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry,
 
 	lower_dentry = d_alloc(lower_dir_dentry, &this);
 	if (!lower_dentry) {
+		/* still need ->d_release to free our d_fsdata */
+		wrapfs_set_d_op(dentry, NULL);
 		err = -ENOMEM;
 		goto out;
 	}
 	d_add(lower_dentry, NULL); /* instantiate and hash */
 
 setup_lower:
+	wrapfs_set_d_op(dentry, lower_dentry);
 	lower_path.dentry = lower_dentry;
 	lower_path.mnt = mntget(lower_dir_mnt);
 	wrapfs_set_lower_path(dentry, &lower_path);
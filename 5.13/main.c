@@ -9,6 +9,109 @@
 #include "wrapfs.h"
 #include <linux/module.h>
 
+/* what wrapfs_mount hands over to wrapfs_read_super */
+struct wrapfs_mount_data {
+    const char *dev_name;
+    char *options;
+};
+
+enum {
+    Opt_lazy_attr,
+    Opt_ra_min_kb,
+    Opt_ra_max_kb,
+    Opt_wb_max_kb,
+    Opt_wb_limit_kb,
+    Opt_prefetch_kb,
+    Opt_pin_max_kb,
+    Opt_inode_cache,
+    Opt_err,
+};
+
+static const match_table_t wrapfs_tokens = {
+    {Opt_lazy_attr, "lazy_attr"},
+    {Opt_ra_min_kb, "ra_min_kb=%u"},
+    {Opt_ra_max_kb, "ra_max_kb=%u"},
+    {Opt_wb_max_kb, "wb_max_kb=%u"},
+    {Opt_wb_limit_kb, "wb_limit_kb=%u"},
+    {Opt_prefetch_kb, "prefetch_kb=%u"},
+    {Opt_pin_max_kb, "pin_max_kb=%u"},
+    {Opt_inode_cache, "inode_cache=%u"},
+    {Opt_err, NULL},
+};
+
+int wrapfs_parse_options(struct wrapfs_sb_info *sbi, char *options) {
+    char *p;
+    substring_t args[MAX_OPT_ARGS];
+    int option;
+
+    sbi->ra_min = WRAPFS_RA_MIN_DEFAULT;
+    sbi->wb_limit = WRAPFS_WB_LIMIT_DEFAULT;
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        switch (match_token(p, wrapfs_tokens, args)) {
+        case Opt_lazy_attr:
+            sbi->mount_opt |= WRAPFS_MOUNT_LAZY_ATTR;
+            break;
+        case Opt_ra_min_kb:
+            if (match_int(&args[0], &option) || option < 0)
+                goto bad_value;
+            sbi->ra_min = (unsigned long)option << 10;
+            break;
+        case Opt_ra_max_kb:
+            if (match_int(&args[0], &option) || option < 0)
+                goto bad_value;
+            sbi->ra_max = (unsigned long)option << 10;
+            break;
+        case Opt_wb_max_kb:
+            if (match_int(&args[0], &option) || option < 0)
+                goto bad_value;
+            sbi->wb_max = (unsigned long)option << 10;
+            break;
+        case Opt_wb_limit_kb:
+            if (match_int(&args[0], &option) || option < 0)
+                goto bad_value;
+            sbi->wb_limit = (unsigned long)option << 10;
+            break;
+        case Opt_prefetch_kb:
+            if (match_int(&args[0], &option) || option < 0)
+                goto bad_value;
+            sbi->pf_max = (loff_t)option << 10;
+            break;
+        case Opt_pin_max_kb:
+            if (match_int(&args[0], &option) || option < 0)
+                goto bad_value;
+            sbi->pin_max = (loff_t)option << 10;
+            break;
+        case Opt_inode_cache:
+            if (match_int(&args[0], &option) || option < 0)
+                goto bad_value;
+            sbi->inode_cache = option;
+            break;
+        default:
+            printk(KERN_ERR "wrapfs: unrecognized mount option '%s'\n", p);
+            return -EINVAL;
+        }
+    }
+
+    if (sbi->ra_max && sbi->ra_min > sbi->ra_max) {
+        printk(KERN_ERR "wrapfs: ra_min_kb is larger than ra_max_kb\n");
+        return -EINVAL;
+    }
+    if (sbi->wb_max > sbi->wb_limit) {
+        printk(KERN_ERR "wrapfs: wb_max_kb is larger than wb_limit_kb\n");
+        return -EINVAL;
+    }
+    return 0;
+
+bad_value:
+    printk(KERN_ERR "wrapfs: bad value in mount option '%s'\n", p);
+    return -EINVAL;
+}
+
 /*
  * There is no need to lock the wrapfs_super_info's rwsem as there is no
  * way anyone can have a reference to the superblock at this point in time.
@@ -18,7 +121,8 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data,
     int err = 0;
     struct super_block *lower_sb;
     struct path lower_path;
-    char *dev_name = (char *)raw_data;
+    struct wrapfs_mount_data *data = raw_data;
+    const char *dev_name = data->dev_name;
     struct inode *inode;
 
     if (!dev_name) {
@@ -43,6 +147,16 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data,
         err = -ENOMEM;
         goto out_free;
     }
+    mutex_init(&WRAPFS_SB(sb)->plan_lock);
+    mutex_init(&WRAPFS_SB(sb)->pin_lock);
+    INIT_LIST_HEAD(&WRAPFS_SB(sb)->pins);
+    INIT_WORK(&WRAPFS_SB(sb)->pin_work, wrapfs_pin_recharge_work);
+    INIT_WORK(&WRAPFS_SB(sb)->inode_trim, wrapfs_inode_trim_work);
+    WRAPFS_SB(sb)->sb = sb;
+
+    err = wrapfs_parse_options(WRAPFS_SB(sb), data->options);
+    if (err)
+        goto out_freesbi;
 
     /* set the lower superblock field of upper superblock */
     lower_sb = lower_path.dentry->d_sb;
@@ -74,7 +188,7 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data,
         err = -ENOMEM;
         goto out_iput;
     }
-    d_set_d_op(sb->s_root, &wrapfs_dops);
+    wrapfs_set_d_op(sb->s_root, lower_path.dentry);
 
     /* link the upper and lower dentries */
     sb->s_root->d_fsdata = NULL;
@@ -106,6 +220,7 @@ out_iput:
 out_sput:
     /* drop refs we took earlier */
     atomic_dec(&lower_sb->s_active);
+out_freesbi:
     kfree(WRAPFS_SB(sb));
     sb->s_fs_info = NULL;
 out_free:
@@ -117,9 +232,12 @@ out:
 
 struct dentry *wrapfs_mount(struct file_system_type *fs_type, int flags,
                             const char *dev_name, void *raw_data) {
-    void *lower_path_name = (void *)dev_name;
+    struct wrapfs_mount_data data = {
+        .dev_name = dev_name,
+        .options = raw_data,
+    };
 
-    return mount_nodev(fs_type, flags, lower_path_name, wrapfs_read_super);
+    return mount_nodev(fs_type, flags, &data, wrapfs_read_super);
 }
 
 static struct file_system_type wrapfs_fs_type = {
@@ -140,6 +258,9 @@ static int __init init_wrapfs_fs(void) {
     if (err)
         goto out;
     err = wrapfs_init_dentry_cache();
+    if (err)
+        goto out;
+    err = wrapfs_init_aio_cache();
     if (err)
         goto out;
     err = register_filesystem(&wrapfs_fs_type);
@@ -147,6 +268,7 @@ out:
     if (err) {
         wrapfs_destroy_inode_cache();
         wrapfs_destroy_dentry_cache();
+        wrapfs_destroy_aio_cache();
     }
     return err;
 }
@@ -154,6 +276,7 @@ out:
 static void __exit exit_wrapfs_fs(void) {
     wrapfs_destroy_inode_cache();
     wrapfs_destroy_dentry_cache();
+    wrapfs_destroy_aio_cache();
     unregister_filesystem(&wrapfs_fs_type);
     pr_info("Completed wrapfs module unload\n");
 }
@@ -8,92 +8,19 @@
 
 #include "wrapfs.h"
 
-static vm_fault_t wrapfs_fault(struct vm_fault *vmf) {
-    vm_fault_t err;
-    struct vm_area_struct *vma = vmf->vma;
-    struct file *file, *lower_file;
-    const struct vm_operations_struct *lower_vm_ops;
-    struct vm_area_struct lower_vma;
-    struct vm_area_struct *plower_vma = &lower_vma;
-
-    memcpy(plower_vma, vma, sizeof(struct vm_area_struct));
-    file = lower_vma.vm_file;
-    lower_vm_ops = WRAPFS_F(file)->lower_vm_ops;
-    BUG_ON(!lower_vm_ops);
-
-    lower_file = wrapfs_lower_file(file);
-    /*
-     * XXX: vm_ops->fault may be called in parallel.  Because we have to
-     * resort to temporarily changing the vma->vm_file to point to the
-     * lower file, a concurrent invocation of wrapfs_fault could see a
-     * different value.  In this workaround, we keep a different copy of
-     * the vma structure in our stack, so we never expose a different
-     * value of the vma->vm_file called to us, even temporarily.  A
-     * better fix would be to change the calling semantics of ->fault to
-     * take an explicit file pointer.
-     */
-    lower_vma.vm_file = lower_file;
-    memcpy((void *)&vmf->vma, (void *)&plower_vma,
-           sizeof(struct vm_area_struct *)); /* override vma temporarily */
-    err = lower_vm_ops->fault(vmf);
-    // vmf->vma = vma; /* restore vma*/
-    memcpy((void *)&vmf->vma, (void *)&vma,
-           sizeof(struct vm_area_struct *)); /* restore vma */
-    return err;
-}
-
-static vm_fault_t wrapfs_page_mkwrite(struct vm_fault *vmf) {
-    vm_fault_t err = 0;
-    struct vm_area_struct *vma = vmf->vma;
-    struct file *file, *lower_file;
-    const struct vm_operations_struct *lower_vm_ops;
-    struct vm_area_struct lower_vma;
-    struct vm_area_struct *plower_vma = &lower_vma;
-
-    memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
-    file = lower_vma.vm_file;
-    lower_vm_ops = WRAPFS_F(file)->lower_vm_ops;
-    BUG_ON(!lower_vm_ops);
-    if (!lower_vm_ops->page_mkwrite)
-        goto out;
-
-    lower_file = wrapfs_lower_file(file);
-    /*
-     * XXX: vm_ops->page_mkwrite may be called in parallel.
-     * Because we have to resort to temporarily changing the
-     * vma->vm_file to point to the lower file, a concurrent
-     * invocation of wrapfs_page_mkwrite could see a different
-     * value.  In this workaround, we keep a different copy of the
-     * vma structure in our stack, so we never expose a different
-     * value of the vma->vm_file called to us, even temporarily.
-     * A better fix would be to change the calling semantics of
-     * ->page_mkwrite to take an explicit file pointer.
-     */
-    lower_vma.vm_file = lower_file;
-    memcpy((void *)&vmf->vma, (void *)&plower_vma,
-           sizeof(struct vm_area_struct *)); /* override vma temporarily */
-    err = lower_vm_ops->page_mkwrite(vmf);
-    memcpy((void *)&vmf->vma, (void *)&vma,
-           sizeof(struct vm_area_struct *)); /* restore vma */
-
-out:
-    return err;
-}
-
+/*
+ * Our ->read_iter/->write_iter never go through the upper page cache, so
+ * there is nothing to bypass here: anyone reaching ->direct_IO is simply
+ * sent down the regular passthrough path, which hands IOCB_DIRECT
+ * requests to the lower file.  Open regular files use the lower mapping
+ * as f_mapping, so the VFS O_DIRECT checks see the lower ->direct_IO.
+ */
 static ssize_t wrapfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter) {
-    /*
-     * This function should never be called directly.  We need it
-     * to exist, to get past a check in open_check_o_direct(),
-     * which is called from do_last().
-     */
-    return -EINVAL;
+    if (iov_iter_rw(iter) == READ)
+        return wrapfs_read_iter(iocb, iter);
+    return wrapfs_write_iter(iocb, iter);
 }
 
 const struct address_space_operations wrapfs_aops = {
     .direct_IO = wrapfs_direct_IO,
 };
-
-const struct vm_operations_struct wrapfs_vm_ops = {
-    .fault = wrapfs_fault,
-    .page_mkwrite = wrapfs_page_mkwrite,
-};
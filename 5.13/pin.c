@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 1998-2020 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2020 Stony Brook University
+ * Copyright (c) 2003-2020 The Research Foundation of SUNY
+ */
+
+#include "wrapfs.h"
+#include <linux/capability.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/swap.h>
+
+/*
+ * Pinned residency set.
+ *
+ * WRAPFS_IOC_PIN on an open file keeps the lower page cache of that file
+ * resident, the way SHM_LOCK keeps a shm segment: the lower mapping is
+ * marked unevictable, reclaim moves its pages to the unevictable list
+ * instead of dropping them, and we hold a reference to the lower inode so
+ * the mapping is not torn down with it.  The file is then read in once.
+ * Pages that are truncated, or that readahead skipped, are simply gone or
+ * read back (and kept) on the next access.
+ *
+ * Each pin charges the file size against the pin_max_kb mount option.
+ * The charge follows the file: when a pinned file changes size, through
+ * wrapfs or seen at the next pin request, it is recharged, and a file
+ * that outgrows the budget is dropped from the set.  So is a file that
+ * was unlinked, which nothing could unpin any more once it is closed.
+ * The set is dropped on unmount.  Like mlock, pinning needs CAP_IPC_LOCK.
+ *
+ * The unevictable flag lives in the lower mapping, which several wrapfs
+ * mounts may pin at once, so who set it is tracked per lower inode: the
+ * flag is cleared when the last pin of the lower inode goes, and only if
+ * it was wrapfs that set it.
+ */
+
+/* all pins of one lower inode, on any mount */
+struct wrapfs_pin_owner {
+    struct list_head list;
+    struct inode *lower_inode;
+    unsigned int count; /* pins of the lower inode */
+    bool unevictable;   /* we made the mapping unevictable */
+};
+
+static DEFINE_MUTEX(wrapfs_pin_owner_lock); /* protects the owner list */
+static LIST_HEAD(wrapfs_pin_owners);
+
+struct wrapfs_pin {
+    struct list_head list;
+    struct inode *lower_inode; /* holds the lower inode and its pages */
+    struct wrapfs_pin_owner *owner;
+    loff_t charge; /* bytes charged against pin_max_kb */
+};
+
+static struct wrapfs_pin *wrapfs_pin_find(struct wrapfs_sb_info *sbi,
+                                          struct inode *lower_inode) {
+    struct wrapfs_pin *pin;
+
+    list_for_each_entry(pin, &sbi->pins, list)
+        if (pin->lower_inode == lower_inode)
+            return pin;
+    return NULL;
+}
+
+/* let reclaim see the pages of a mapping that is evictable again */
+static void wrapfs_pin_move_evictable(struct address_space *mapping) {
+    struct pagevec pvec;
+    pgoff_t index = 0;
+
+    pagevec_init(&pvec);
+    while (pagevec_lookup(&pvec, mapping, &index)) {
+        check_move_unevictable_pages(&pvec);
+        pagevec_release(&pvec);
+        cond_resched();
+    }
+}
+
+/* make the mapping of @lower_inode unevictable, or share in doing so */
+static struct wrapfs_pin_owner *
+wrapfs_pin_owner_get(struct inode *lower_inode) {
+    struct address_space *mapping = lower_inode->i_mapping;
+    struct wrapfs_pin_owner *owner;
+
+    mutex_lock(&wrapfs_pin_owner_lock);
+    list_for_each_entry(owner, &wrapfs_pin_owners, list) {
+        if (owner->lower_inode == lower_inode) {
+            owner->count++;
+            goto out;
+        }
+    }
+    owner = kzalloc(sizeof(*owner), GFP_KERNEL);
+    if (!owner)
+        goto out;
+    owner->lower_inode = lower_inode;
+    owner->count = 1;
+    /* the lower file system may keep this mapping unevictable by itself */
+    if (!mapping_unevictable(mapping)) {
+        mapping_set_unevictable(mapping);
+        owner->unevictable = true;
+    }
+    list_add(&owner->list, &wrapfs_pin_owners);
+out:
+    mutex_unlock(&wrapfs_pin_owner_lock);
+    return owner;
+}
+
+static void wrapfs_pin_owner_put(struct wrapfs_pin_owner *owner) {
+    struct address_space *mapping = owner->lower_inode->i_mapping;
+
+    mutex_lock(&wrapfs_pin_owner_lock);
+    if (--owner->count) {
+        mutex_unlock(&wrapfs_pin_owner_lock);
+        return;
+    }
+    list_del(&owner->list);
+    /* under the lock, so that a new pin cannot see the flag still set */
+    if (owner->unevictable) {
+        mapping_clear_unevictable(mapping);
+        wrapfs_pin_move_evictable(mapping);
+    }
+    mutex_unlock(&wrapfs_pin_owner_lock);
+    kfree(owner);
+}
+
+/* called with sbi->pin_lock held */
+static void wrapfs_pin_release(struct wrapfs_sb_info *sbi,
+                               struct wrapfs_pin *pin) {
+    list_del(&pin->list);
+    sbi->pin_bytes -= pin->charge;
+    wrapfs_pin_owner_put(pin->owner);
+    iput(pin->lower_inode);
+    kfree(pin);
+}
+
+/*
+ * Charge @pin for the current size of its file, or drop it if that does
+ * not fit into the budget any more or the file is gone.  Called with
+ * sbi->pin_lock held.
+ */
+static void wrapfs_pin_recharge(struct wrapfs_sb_info *sbi,
+                                struct wrapfs_pin *pin) {
+    loff_t size = round_up(i_size_read(pin->lower_inode), PAGE_SIZE);
+
+    if (!READ_ONCE(pin->lower_inode->i_nlink)) {
+        wrapfs_pin_release(sbi, pin);
+        return;
+    }
+
+    if (size > pin->charge &&
+        size - pin->charge > sbi->pin_max - sbi->pin_bytes) {
+        pr_warn_ratelimited("wrapfs: pinned file outgrew pin_max_kb, "
+                            "unpinned it\n");
+        wrapfs_pin_release(sbi, pin);
+        return;
+    }
+    sbi->pin_bytes += size - pin->charge;
+    pin->charge = size;
+}
+
+/* called with sbi->pin_lock held */
+static void wrapfs_pin_recharge_all(struct wrapfs_sb_info *sbi) {
+    struct wrapfs_pin *pin, *next;
+
+    list_for_each_entry_safe(pin, next, &sbi->pins, list)
+        wrapfs_pin_recharge(sbi, pin);
+}
+
+/* queued by wrapfs_pin_note_change */
+void wrapfs_pin_recharge_work(struct work_struct *work) {
+    struct wrapfs_sb_info *sbi =
+        container_of(work, struct wrapfs_sb_info, pin_work);
+
+    mutex_lock(&sbi->pin_lock);
+    wrapfs_pin_recharge_all(sbi);
+    mutex_unlock(&sbi->pin_lock);
+}
+
+static long wrapfs_pin(struct file *file) {
+    long err = 0;
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct file *lower_file = wrapfs_lower_file(file);
+    struct inode *lower_inode = file_inode(lower_file);
+    struct wrapfs_pin *pin;
+    loff_t size;
+
+    if (!S_ISREG(lower_inode->i_mode))
+        return -EINVAL;
+    if (!(file->f_mode & FMODE_READ))
+        return -EBADF;
+
+    pin = kzalloc(sizeof(*pin), GFP_KERNEL);
+    if (!pin)
+        return -ENOMEM;
+    size = round_up(i_size_read(lower_inode), PAGE_SIZE);
+
+    mutex_lock(&sbi->pin_lock);
+    if (wrapfs_pin_find(sbi, lower_inode)) {
+        err = -EEXIST;
+        goto out_unlock;
+    }
+    /* pinned files may have grown behind our back */
+    wrapfs_pin_recharge_all(sbi);
+    if (size > sbi->pin_max - sbi->pin_bytes) {
+        err = -ENOSPC;
+        goto out_unlock;
+    }
+    pin->owner = wrapfs_pin_owner_get(lower_inode);
+    if (!pin->owner) {
+        err = -ENOMEM;
+        goto out_unlock;
+    }
+    pin->lower_inode = igrab(lower_inode);
+    pin->charge = size;
+    sbi->pin_bytes += size;
+    list_add_tail(&pin->list, &sbi->pins);
+    pin = NULL;
+out_unlock:
+    mutex_unlock(&sbi->pin_lock);
+    kfree(pin);
+    if (err)
+        return err;
+
+    /* read it in once; whatever makes it into the cache now stays */
+    if (size && !wrapfs_fill_cache(lower_file, 0, size))
+        wrapfs_wait_cache(lower_inode->i_mapping, 0, size, NULL);
+    return 0;
+}
+
+static long wrapfs_unpin(struct file *file) {
+    long err = 0;
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct wrapfs_pin *pin;
+
+    mutex_lock(&sbi->pin_lock);
+    pin = wrapfs_pin_find(sbi, file_inode(wrapfs_lower_file(file)));
+    if (pin)
+        wrapfs_pin_release(sbi, pin);
+    else
+        err = -ENOENT;
+    mutex_unlock(&sbi->pin_lock);
+    return err;
+}
+
+void wrapfs_pin_get_status(struct super_block *sb,
+                           struct wrapfs_pin_status *status) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+    struct wrapfs_pin *pin;
+    unsigned long nrpages = 0;
+
+    memset(status, 0, sizeof(*status));
+    status->budget = sbi->pin_max;
+    /* read-only: this is also reached from /proc/self/mountstats */
+    mutex_lock(&sbi->pin_lock);
+    status->pinned = sbi->pin_bytes;
+    list_for_each_entry(pin, &sbi->pins, list) {
+        nrpages += READ_ONCE(pin->lower_inode->i_mapping->nrpages);
+        status->nr_files++;
+    }
+    status->resident = (u64)nrpages << PAGE_SHIFT;
+    mutex_unlock(&sbi->pin_lock);
+}
+
+long wrapfs_pin_ioctl(struct file *file, unsigned int cmd,
+                      unsigned long arg) {
+    struct wrapfs_pin_status status;
+
+    if (!WRAPFS_SB(file_inode(file)->i_sb)->pin_max)
+        return -EOPNOTSUPP;
+
+    switch (cmd) {
+    case WRAPFS_IOC_PIN:
+        if (!capable(CAP_IPC_LOCK))
+            return -EPERM;
+        return wrapfs_pin(file);
+    case WRAPFS_IOC_UNPIN:
+        if (!capable(CAP_IPC_LOCK))
+            return -EPERM;
+        return wrapfs_unpin(file);
+    case WRAPFS_IOC_PIN_STATUS:
+        wrapfs_pin_get_status(file_inode(file)->i_sb, &status);
+        if (copy_to_user((void __user *)arg, &status, sizeof(status)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* unmount: drop the whole pin set */
+void wrapfs_pin_destroy(struct super_block *sb) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+    struct wrapfs_pin *pin, *next;
+
+    cancel_work_sync(&sbi->pin_work);
+    mutex_lock(&sbi->pin_lock);
+    list_for_each_entry_safe(pin, next, &sbi->pins, list)
+        wrapfs_pin_release(sbi, pin);
+    mutex_unlock(&sbi->pin_lock);
+}
@@ -0,0 +1,345 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 1998-2020 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2020 Stony Brook University
+ * Copyright (c) 2003-2020 The Research Foundation of SUNY
+ */
+
+#include "wrapfs.h"
+#include <linux/cred.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+
+/*
+ * Access-plan prefetching.
+ *
+ * Applications that know which files they will read next (the shuffled
+ * file order of the next training epoch, say) hand that list to wrapfs
+ * with WRAPFS_IOC_PLAN_START.  A worker walks the list in order and keeps
+ * up to depth entries in flight: it opens each file with the credentials
+ * of the task that started the plan, starts readahead of the requested
+ * range on the lower file, and retires the oldest entry once its pages
+ * are up to date in the lower page cache.  With at most depth files open
+ * and being read at any time, a long plan cannot flood the lower file
+ * system, and the application's reads later hit the page cache.
+ *
+ * Files are only opened if the task that started the plan could read
+ * them itself.  The plan, and the page cache it reads in from the worker,
+ * are charged to the memory cgroup of that task.
+ *
+ * One plan runs per mount at a time.  WRAPFS_IOC_PLAN_STATUS reports the
+ * progress of the last plan and WRAPFS_IOC_PLAN_CANCEL stops it.  A
+ * running plan holds a reference to the mount it was started on, so
+ * unmounting fails with EBUSY until it finished or was cancelled.
+ */
+
+struct wrapfs_plan_ent {
+    char *name;
+    loff_t offset;
+    loff_t length; /* 0 up to the end of the file */
+};
+
+struct wrapfs_plan {
+    struct work_struct work;
+    struct path root;        /* paths are looked up from here */
+    const struct cred *cred; /* of the task that started the plan */
+    struct mem_cgroup *memcg; /* ... and its memory cgroup */
+    struct wrapfs_plan_ent *ents;
+    unsigned int nr;
+    unsigned int depth;
+    struct file **ring; /* the entries in flight */
+    /* progress, read without locking by WRAPFS_IOC_PLAN_STATUS */
+    unsigned int done;
+    unsigned int errors;
+    u64 bytes;
+    u32 state;
+    bool cancel;
+};
+
+static void wrapfs_plan_free_ents(struct wrapfs_plan *plan) {
+    unsigned int i;
+
+    for (i = 0; i < plan->nr; i++)
+        kfree(plan->ents[i].name);
+    kvfree(plan->ents);
+    plan->ents = NULL;
+    kfree(plan->ring);
+    plan->ring = NULL;
+}
+
+/* open the file of @ent and start readahead of its range */
+static struct file *wrapfs_plan_issue(struct wrapfs_plan *plan,
+                                      struct wrapfs_plan_ent *ent) {
+    int err;
+    struct path path;
+    struct file *file;
+    loff_t size;
+
+    err = vfs_path_lookup(plan->root.dentry, plan->root.mnt, ent->name,
+                          LOOKUP_FOLLOW, &path);
+    if (err)
+        return ERR_PTR(err);
+    /* never open anything that may block on open, like a fifo */
+    if (path.mnt->mnt_sb != plan->root.mnt->mnt_sb ||
+        !d_is_reg(path.dentry)) {
+        err = -EINVAL;
+        goto out_put;
+    }
+    /* dentry_open does not check permissions, we run with plan->cred */
+    err = inode_permission(mnt_user_ns(path.mnt), d_inode(path.dentry),
+                           MAY_READ | MAY_OPEN);
+    if (err)
+        goto out_put;
+    file = dentry_open(&path, O_RDONLY | O_LARGEFILE, plan->cred);
+    path_put(&path);
+    if (IS_ERR(file))
+        return file;
+
+    size = i_size_read(file_inode(file));
+    if (ent->offset >= size) {
+        ent->length = 0;
+        return file;
+    }
+    if (!ent->length || ent->length > size - ent->offset)
+        ent->length = size - ent->offset;
+
+    err = wrapfs_fill_cache(wrapfs_lower_file(file), ent->offset,
+                            ent->length);
+    if (err) {
+        fput(file);
+        return ERR_PTR(err);
+    }
+    return file;
+
+out_put:
+    path_put(&path);
+    return ERR_PTR(err);
+}
+
+/* wait for the readahead of @ent to complete, then drop its file */
+static void wrapfs_plan_wait(struct wrapfs_plan *plan,
+                             struct wrapfs_plan_ent *ent, struct file *file) {
+    loff_t bytes;
+
+    if (IS_ERR(file)) {
+        WRITE_ONCE(plan->errors, plan->errors + 1);
+        return;
+    }
+
+    bytes = wrapfs_wait_cache(file->f_mapping, ent->offset, ent->length,
+                              &plan->cancel);
+    WRITE_ONCE(plan->bytes, plan->bytes + bytes);
+    fput(file);
+}
+
+static void wrapfs_plan_work(struct work_struct *work) {
+    struct wrapfs_plan *plan = container_of(work, struct wrapfs_plan, work);
+    unsigned int issued = 0, done = 0, depth = plan->depth;
+    const struct cred *old_cred;
+    struct mem_cgroup *old_memcg;
+    struct path root;
+
+    old_cred = override_creds(plan->cred);
+    old_memcg = set_active_memcg(plan->memcg);
+    while (done < plan->nr) {
+        while (issued < plan->nr && issued - done < depth &&
+               !READ_ONCE(plan->cancel)) {
+            plan->ring[issued % depth] =
+                wrapfs_plan_issue(plan, &plan->ents[issued]);
+            issued++;
+        }
+        if (done == issued)
+            break;
+        wrapfs_plan_wait(plan, &plan->ents[done], plan->ring[done % depth]);
+        WRITE_ONCE(plan->done, ++done);
+    }
+    set_active_memcg(old_memcg);
+    revert_creds(old_cred);
+
+    /* keep only the progress counters around for WRAPFS_IOC_PLAN_STATUS */
+    wrapfs_plan_free_ents(plan);
+    put_cred(plan->cred);
+    plan->cred = NULL;
+    mem_cgroup_put(plan->memcg);
+    plan->memcg = NULL;
+    if (READ_ONCE(plan->cancel))
+        WRITE_ONCE(plan->done, plan->nr);
+    WRITE_ONCE(plan->state, READ_ONCE(plan->cancel) ? WRAPFS_PLAN_CANCELLED
+                                                    : WRAPFS_PLAN_DONE);
+    /* may drop the last reference to the mount: touch nothing after it */
+    root = plan->root;
+    path_put(&root);
+}
+
+/*
+ * strndup_user, but charged to the caller's memory cgroup and within what
+ * is left of the plan's path budget @left.
+ */
+static char *wrapfs_plan_strdup(const char __user *upath, size_t *left) {
+    long len;
+    char *name;
+
+    len = strnlen_user(upath, PATH_MAX);
+    if (!len)
+        return ERR_PTR(-EFAULT);
+    if (len > PATH_MAX)
+        return ERR_PTR(-ENAMETOOLONG);
+    if (len > *left)
+        return ERR_PTR(-E2BIG);
+
+    name = kmalloc(len, GFP_KERNEL_ACCOUNT);
+    if (!name)
+        return ERR_PTR(-ENOMEM);
+    /* the string may have changed since strnlen_user */
+    if (copy_from_user(name, upath, len - 1)) {
+        kfree(name);
+        return ERR_PTR(-EFAULT);
+    }
+    name[len - 1] = '\0';
+    *left -= len;
+    return name;
+}
+
+static long wrapfs_plan_start(struct file *file,
+                              struct wrapfs_plan_args __user *uargs) {
+    long err;
+    unsigned int i;
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct wrapfs_plan_entry __user *uents;
+    struct wrapfs_plan_entry uent;
+    struct wrapfs_plan_args args;
+    struct wrapfs_plan *plan, *old;
+    size_t left = WRAPFS_PLAN_MAX_PATH_BYTES;
+
+    if (copy_from_user(&args, uargs, sizeof(args)))
+        return -EFAULT;
+    if (!args.nr_entries || args.nr_entries > WRAPFS_PLAN_MAX_ENTRIES ||
+        args.depth > WRAPFS_PLAN_MAX_DEPTH)
+        return -EINVAL;
+
+    plan = kzalloc(sizeof(*plan), GFP_KERNEL_ACCOUNT);
+    if (!plan)
+        return -ENOMEM;
+    plan->depth = args.depth ?: WRAPFS_PLAN_DEFAULT_DEPTH;
+    plan->ents =
+        kvcalloc(args.nr_entries, sizeof(*plan->ents), GFP_KERNEL_ACCOUNT);
+    plan->ring = kcalloc(plan->depth, sizeof(*plan->ring), GFP_KERNEL_ACCOUNT);
+    if (!plan->ents || !plan->ring) {
+        err = -ENOMEM;
+        goto out_free;
+    }
+
+    uents = u64_to_user_ptr(args.entries);
+    for (i = 0; i < args.nr_entries; i++) {
+        if (copy_from_user(&uent, &uents[i], sizeof(uent))) {
+            err = -EFAULT;
+            goto out_free;
+        }
+        if (uent.offset > LLONG_MAX || uent.length > LLONG_MAX) {
+            err = -EINVAL;
+            goto out_free;
+        }
+        plan->ents[i].name =
+            wrapfs_plan_strdup(u64_to_user_ptr(uent.path), &left);
+        if (IS_ERR(plan->ents[i].name)) {
+            err = PTR_ERR(plan->ents[i].name);
+            plan->ents[i].name = NULL;
+            goto out_free;
+        }
+        plan->ents[i].offset = uent.offset;
+        plan->ents[i].length = uent.length;
+        plan->nr = i + 1;
+        cond_resched();
+    }
+    INIT_WORK(&plan->work, wrapfs_plan_work);
+    plan->state = WRAPFS_PLAN_RUNNING;
+
+    mutex_lock(&sbi->plan_lock);
+    old = sbi->plan;
+    if (old && READ_ONCE(old->state) == WRAPFS_PLAN_RUNNING) {
+        mutex_unlock(&sbi->plan_lock);
+        err = -EBUSY;
+        goto out_free;
+    }
+    plan->cred = get_current_cred();
+    plan->memcg = get_mem_cgroup_from_mm(current->mm);
+    plan->root.mnt = mntget(file->f_path.mnt);
+    plan->root.dentry = dget(file->f_path.mnt->mnt_root);
+    sbi->plan = plan;
+    queue_work(system_unbound_wq, &plan->work);
+    mutex_unlock(&sbi->plan_lock);
+
+    /* the old worker may still be on its way out */
+    if (old) {
+        flush_work(&old->work);
+        kfree(old);
+    }
+    return 0;
+
+out_free:
+    wrapfs_plan_free_ents(plan);
+    kfree(plan);
+    return err;
+}
+
+static long wrapfs_plan_status(struct file *file,
+                               struct wrapfs_plan_status __user *ustatus) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct wrapfs_plan_status status = {.state = WRAPFS_PLAN_NONE};
+    struct wrapfs_plan *plan;
+
+    mutex_lock(&sbi->plan_lock);
+    plan = sbi->plan;
+    if (plan) {
+        status.state = READ_ONCE(plan->state);
+        status.nr_entries = plan->nr;
+        status.done = READ_ONCE(plan->done);
+        status.errors = READ_ONCE(plan->errors);
+        status.bytes = READ_ONCE(plan->bytes);
+    }
+    mutex_unlock(&sbi->plan_lock);
+
+    if (copy_to_user(ustatus, &status, sizeof(status)))
+        return -EFAULT;
+    return 0;
+}
+
+/* stop the running plan, if any, and wait for its worker to finish */
+static long wrapfs_plan_cancel(struct file *file) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+
+    mutex_lock(&sbi->plan_lock);
+    if (sbi->plan) {
+        WRITE_ONCE(sbi->plan->cancel, true);
+        flush_work(&sbi->plan->work);
+    }
+    mutex_unlock(&sbi->plan_lock);
+    return 0;
+}
+
+long wrapfs_plan_ioctl(struct file *file, unsigned int cmd,
+                       unsigned long arg) {
+    switch (cmd) {
+    case WRAPFS_IOC_PLAN_START:
+        return wrapfs_plan_start(file, (void __user *)arg);
+    case WRAPFS_IOC_PLAN_STATUS:
+        return wrapfs_plan_status(file, (void __user *)arg);
+    case WRAPFS_IOC_PLAN_CANCEL:
+        return wrapfs_plan_cancel(file);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* unmount: the plan is not running, it held a reference to the mount */
+void wrapfs_plan_destroy(struct super_block *sb) {
+    struct wrapfs_plan *plan = WRAPFS_SB(sb)->plan;
+
+    if (!plan)
+        return;
+    flush_work(&plan->work);
+    kfree(plan);
+    WRAPFS_SB(sb)->plan = NULL;
+}
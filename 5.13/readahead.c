@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 1998-2020 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2020 Stony Brook University
+ * Copyright (c) 2003-2020 The Research Foundation of SUNY
+ */
+
+
+#include "wrapfs.h"
+#include <linux/math64.h>
+#include <linux/pagemap.h>
+
+/*
+ * Adaptive sequential readahead.
+ *
+ * The lower file system only knows the lower file's own readahead window,
+ * which on NFS or a slow disk is far too small to keep a small-buffer
+ * sequential reader busy.  For each open file we detect sequential streams
+ * and keep enough lower readahead in flight to cover the lower latency at
+ * the rate the reader consumes data: the window is twice the observed
+ * bandwidth-delay product, clamped to the ra_min_kb/ra_max_kb mount
+ * options.
+ *
+ * The state is updated without locking, like struct file_ra_state: racing
+ * readers on a shared file descriptor can only make the heuristic less
+ * accurate, never incorrect.
+ */
+
+/*
+ * Record a completed synchronous read of @count bytes at @pos, which
+ * started at @start_ns, and issue more lower readahead if the reader got
+ * within half a window of the data already requested.
+ */
+void wrapfs_ra_done(struct file *file, loff_t pos, size_t count, u64 start_ns) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct wrapfs_ra_state *ra = &WRAPFS_F(file)->ra;
+    struct file *lower_file = wrapfs_lower_file(file);
+    u64 now = ktime_get_ns();
+    u64 lat = now - start_ns;
+    u64 window, bdp;
+    loff_t len;
+
+    /* random access or a new stream: start measuring from scratch */
+    if (pos != ra->next || !ra->stream_bytes) {
+        ra->stream_start = start_ns;
+        ra->stream_bytes = count;
+        ra->next = pos + count;
+        ra->issued = ra->next;
+        ra->lat_ns = lat;
+        return;
+    }
+
+    ra->next = pos + count;
+    ra->stream_bytes += count;
+
+    /*
+     * Hold the worst recent latency, which is what a read that misses the
+     * lower cache sees, and let it decay slowly over cache hits.
+     */
+    if (lat > ra->lat_ns)
+        ra->lat_ns = lat;
+    else
+        ra->lat_ns -= ra->lat_ns >> 4;
+
+    bdp = mul_u64_u64_div_u64(ra->stream_bytes, ra->lat_ns,
+                              max_t(u64, now - ra->stream_start, 1));
+    window = clamp_t(u64, 2 * bdp, sbi->ra_min, sbi->ra_max);
+
+    if (ra->issued < ra->next)
+        ra->issued = ra->next;
+    if (ra->issued - ra->next >= window / 2)
+        return;
+
+    /* let the lower readahead (and WILLNEED below) use the whole window */
+    if (lower_file->f_ra.ra_pages < window >> PAGE_SHIFT)
+        lower_file->f_ra.ra_pages = window >> PAGE_SHIFT;
+
+    len = ra->next + window - ra->issued;
+    vfs_fadvise(lower_file, ra->issued, len, POSIX_FADV_WILLNEED);
+    ra->issued += len;
+}
+
+/*
+ * Whole-file prefetch for small files.
+ *
+ * Files of at most prefetch_kb are read into the lower page cache when
+ * they are opened for reading, so that the first read() does not have to
+ * wait for the lower file system.  Open only submits the readahead I/O,
+ * it does not wait for it.  Whether that paid off is accounted per mount
+ * and shown in /proc/self/mountstats: a hit is a prefetched file whose
+ * first read found its data cached, wasted bytes were prefetched but not
+ * read by the time the file was closed.
+ */
+void wrapfs_prefetch_open(struct file *file) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct file *lower_file = wrapfs_lower_file(file);
+    loff_t size = i_size_read(file_inode(lower_file));
+
+    if (!(file->f_mode & FMODE_READ) ||
+        (file->f_flags & (O_DIRECT | O_TRUNC)) || !size || size > sbi->pf_max)
+        return;
+
+    if (wrapfs_fill_cache(lower_file, 0, size))
+        return;
+
+    WRAPFS_F(file)->pf.len = size;
+    atomic64_inc(&sbi->pf_files);
+}
+
+/* first read of a prefetched file: is the data there already? */
+void wrapfs_prefetch_hit(struct file *file, loff_t pos) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct file *lower_file = wrapfs_lower_file(file);
+    struct page *page;
+
+    WRAPFS_F(file)->pf.checked = true;
+    page = find_get_page(lower_file->f_mapping, pos >> PAGE_SHIFT);
+    if (!page)
+        return;
+    if (PageUptodate(page))
+        atomic64_inc(&sbi->pf_hits);
+    put_page(page);
+}
+
+void wrapfs_prefetch_release(struct file *file) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(file)->i_sb);
+    struct wrapfs_pf_state *pf = &WRAPFS_F(file)->pf;
+
+    if (pf->len > pf->seen)
+        atomic64_add(pf->len - pf->seen, &sbi->pf_wasted);
+}
+
+/*
+ * Start reading @len bytes at @pos of @lower_file into the page cache,
+ * without waiting for the I/O.  WILLNEED stops at the readahead window of
+ * the file, which we leave alone, so issue it one window at a time.
+ */
+int wrapfs_fill_cache(struct file *lower_file, loff_t pos, loff_t len) {
+    int err = 0;
+    loff_t chunk = (loff_t)lower_file->f_ra.ra_pages << PAGE_SHIFT;
+    loff_t n;
+
+    chunk = max_t(loff_t, chunk, WRAPFS_RA_MIN_DEFAULT);
+    while (len > 0 && !err) {
+        n = min(len, chunk);
+        err = vfs_fadvise(lower_file, pos, n, POSIX_FADV_WILLNEED);
+        pos += n;
+        len -= n;
+        cond_resched();
+    }
+    return err;
+}
+
+/*
+ * Wait for the pages of a wrapfs_fill_cache range to be read, or until
+ * *@cancel is set.  Pages readahead skipped (memory pressure) are simply
+ * missing.  Returns the number of bytes found up to date.
+ */
+loff_t wrapfs_wait_cache(struct address_space *mapping, loff_t pos,
+                         loff_t len, const bool *cancel) {
+    pgoff_t index, end;
+    struct page *page;
+    loff_t bytes = 0;
+
+    if (!len)
+        return 0;
+    index = pos >> PAGE_SHIFT;
+    end = (pos + len - 1) >> PAGE_SHIFT;
+    for (; index <= end; index++) {
+        if (cancel && READ_ONCE(*cancel))
+            break;
+        page = find_get_page(mapping, index);
+        if (!page)
+            continue;
+        wait_on_page_locked(page);
+        if (PageUptodate(page))
+            bytes += PAGE_SIZE;
+        put_page(page);
+        cond_resched();
+    }
+    return bytes;
+}
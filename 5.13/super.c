@@ -24,6 +24,10 @@ static void wrapfs_put_super(struct super_block *sb)
 	if (!spd)
 		return;
 
+	cancel_work_sync(&spd->inode_trim);
+	wrapfs_plan_destroy(sb);
+	wrapfs_pin_destroy(sb);
+
 	/* decrement lower super references */
 	s = wrapfs_lower_super(sb);
 	wrapfs_set_lower_super(sb, NULL);
@@ -48,6 +52,30 @@ static int wrapfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	return err;
 }
 
+/*
+ * syncfs(2) and sync(2) on wrapfs: apart from write-behind buffers our
+ * inodes carry no dirty state of their own, so push those down and write
+ * back the lower file system.
+ */
+static int wrapfs_sync_fs(struct super_block *sb, int wait)
+{
+	int err;
+	struct super_block *lower_sb;
+
+	/* sync_filesystem() below already does the non-waiting pass */
+	if (!wait)
+		return 0;
+
+	wrapfs_wb_sync_sb(sb);
+
+	lower_sb = wrapfs_lower_super(sb);
+	down_read(&lower_sb->s_umount);
+	err = sync_filesystem(lower_sb);
+	up_read(&lower_sb->s_umount);
+
+	return err;
+}
+
 /*
  * @flags: numeric mount options
  * @options: mount options string
@@ -55,6 +83,8 @@ static int wrapfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 static int wrapfs_remount_fs(struct super_block *sb, int *flags, char *options)
 {
 	int err = 0;
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_sb_info *new;
 
 	/*
 	 * The VFS will take care of "ro" and "rw" flags among others.  We
@@ -64,12 +94,88 @@ static int wrapfs_remount_fs(struct super_block *sb, int *flags, char *options)
 	if ((*flags & ~(SB_RDONLY | SB_MANDLOCK | SB_SILENT)) != 0) {
 		printk(KERN_ERR
 		       "wrapfs: remount flags 0x%x unsupported\n", *flags);
+		return -EINVAL;
+	}
+	if (!options)
+		return 0;
+
+	/* @options is the complete new set, as for mount */
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	err = wrapfs_parse_options(new, options);
+	if (err)
+		goto out;
+	/* write-behind buffers and pins are sized and charged with these */
+	if (new->wb_max != sbi->wb_max || new->pin_max != sbi->pin_max) {
+		printk(KERN_ERR
+		       "wrapfs: wb_max_kb and pin_max_kb cannot change on remount\n");
 		err = -EINVAL;
+		goto out;
 	}
 
+	sbi->mount_opt = new->mount_opt;
+	sbi->ra_min = new->ra_min;
+	sbi->ra_max = new->ra_max;
+	sbi->wb_limit = new->wb_limit;
+	sbi->pf_max = new->pf_max;
+	sbi->inode_cache = new->inode_cache;
+out:
+	kfree(new);
 	return err;
 }
 
+static int wrapfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct super_block *sb = root->d_sb;
+
+	if (wrapfs_test_opt(sb, LAZY_ATTR))
+		seq_puts(m, ",lazy_attr");
+	if (WRAPFS_SB(sb)->ra_max) {
+		seq_printf(m, ",ra_min_kb=%lu", WRAPFS_SB(sb)->ra_min >> 10);
+		seq_printf(m, ",ra_max_kb=%lu", WRAPFS_SB(sb)->ra_max >> 10);
+	}
+	if (WRAPFS_SB(sb)->wb_max) {
+		seq_printf(m, ",wb_max_kb=%lu", WRAPFS_SB(sb)->wb_max >> 10);
+		seq_printf(m, ",wb_limit_kb=%lu", WRAPFS_SB(sb)->wb_limit >> 10);
+	}
+	if (WRAPFS_SB(sb)->pf_max)
+		seq_printf(m, ",prefetch_kb=%llu",
+			   (unsigned long long)WRAPFS_SB(sb)->pf_max >> 10);
+	if (WRAPFS_SB(sb)->pin_max)
+		seq_printf(m, ",pin_max_kb=%llu",
+			   (unsigned long long)WRAPFS_SB(sb)->pin_max >> 10);
+	if (WRAPFS_SB(sb)->inode_cache)
+		seq_printf(m, ",inode_cache=%lu", WRAPFS_SB(sb)->inode_cache);
+	return 0;
+}
+
+/* per mount statistics, shown in /proc/self/mountstats */
+static int wrapfs_show_stats(struct seq_file *m, struct dentry *root)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(root->d_sb);
+
+	if (sbi->pf_max)
+		seq_printf(m, "\n\tprefetch: files %lld hits %lld wasted_bytes %lld",
+			   atomic64_read(&sbi->pf_files),
+			   atomic64_read(&sbi->pf_hits),
+			   atomic64_read(&sbi->pf_wasted));
+	if (sbi->pin_max) {
+		struct wrapfs_pin_status status;
+
+		wrapfs_pin_get_status(root->d_sb, &status);
+		seq_printf(m, "\n\tpin: files %u pinned_bytes %llu",
+			   status.nr_files, status.pinned);
+		seq_printf(m, " resident_bytes %llu budget_bytes %llu",
+			   status.resident, status.budget);
+	}
+	if (sbi->inode_cache)
+		seq_printf(m, "\n\tinode_cache: unused %lu max %lu",
+			   list_lru_count(&root->d_sb->s_inode_lru),
+			   sbi->inode_cache);
+	return 0;
+}
+
 /*
  * Called by iput() when the inode reference count reached zero
  * and the inode is not hashed anywhere.  Used to clear anything
@@ -82,6 +188,7 @@ static void wrapfs_evict_inode(struct inode *inode)
 
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	wrapfs_wb_evict(inode);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -91,6 +198,65 @@ static void wrapfs_evict_inode(struct inode *inode)
 	iput(lower_inode);
 }
 
+/*
+ * Trim the inode LRU down to inode_cache entries, from its cold end.
+ * prune_icache_sb() is not exported, but the superblock shrinker is
+ * reachable through s_shrink and does the same, taking a share of unused
+ * dentries along (which may free more inodes for the next round).
+ */
+void wrapfs_inode_trim_work(struct work_struct *work)
+{
+	struct wrapfs_sb_info *sbi =
+		container_of(work, struct wrapfs_sb_info, inode_trim);
+	struct super_block *sb = sbi->sb;
+	struct shrink_control sc = { .gfp_mask = GFP_KERNEL };
+	unsigned long count, max = READ_ONCE(sbi->inode_cache);
+	int nid;
+
+	for_each_online_node(nid) {
+		count = list_lru_count(&sb->s_inode_lru);
+		if (count <= max)
+			break;
+		sc.nid = nid;
+		sc.nr_to_scan = min(count - max,
+				    list_lru_count_node(&sb->s_inode_lru, nid));
+		if (!sc.nr_to_scan)
+			continue;
+		if (sb->s_shrink.scan_objects(&sb->s_shrink, &sc) == SHRINK_STOP)
+			break;	/* being unmounted */
+		cond_resched();
+	}
+}
+
+/*
+ * Called by iput() when the last reference to an inode goes away.  By
+ * default the inode is evicted right away.  With inode_cache=N, unused
+ * inodes of files that still exist are instead kept on the superblock's
+ * inode LRU, still hashed and still holding their lower inode, so the
+ * next wrapfs_iget finds them without setting up a new inode.  The inode
+ * just released is the hottest one, so it is always kept; once more than
+ * N inodes are unused, wrapfs_inode_trim_work evicts the coldest ones.
+ * Under memory pressure the superblock shrinker prunes the LRU as well.
+ */
+static int wrapfs_drop_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	unsigned long max = sbi->inode_cache;
+
+	if (!max || generic_drop_inode(inode))
+		return 1;
+	/* do not keep a lower file alive that was unlinked under us */
+	if (!lower_inode || !lower_inode->i_nlink)
+		return 1;
+	/* iput_final does not cache inodes of a dying sb anyway */
+	if ((sb->s_flags & SB_ACTIVE) &&
+	    list_lru_count(&sb->s_inode_lru) >= max)
+		schedule_work(&sbi->inode_trim);
+	return 0;
+}
+
 static struct inode *wrapfs_alloc_inode(struct super_block *sb)
 {
 	struct wrapfs_inode_info *i;
@@ -101,13 +267,21 @@ static struct inode *wrapfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct wrapfs_inode_info, vfs_inode));
+	seqcount_spinlock_init(&i->link_seq, &i->vfs_inode.i_lock);
 
         atomic64_set(&i->vfs_inode.i_version, 1);
 	return &i->vfs_inode;
 }
 
-static void wrapfs_destroy_inode(struct inode *inode)
+/* called after an RCU grace period, RCU-walk may still see the inode */
+static void wrapfs_free_inode(struct inode *inode)
 {
+	struct wrapfs_link *link;
+
+	/* a path walk that failed to leave RCU mode may still hold the body */
+	link = rcu_dereference_protected(WRAPFS_I(inode)->link, 1);
+	if (link)
+		wrapfs_put_link(link);
 	kmem_cache_free(wrapfs_inode_cachep, WRAPFS_I(inode));
 }
 
@@ -135,6 +309,8 @@ int wrapfs_init_inode_cache(void)
 /* wrapfs inode cache destructor */
 void wrapfs_destroy_inode_cache(void)
 {
+	/* inodes are freed from RCU callbacks, wait for the last ones */
+	rcu_barrier();
 	if (wrapfs_inode_cachep)
 		kmem_cache_destroy(wrapfs_inode_cachep);
 }
@@ -155,12 +331,15 @@ static void wrapfs_umount_begin(struct super_block *sb)
 const struct super_operations wrapfs_sops = {
 	.put_super	= wrapfs_put_super,
 	.statfs		= wrapfs_statfs,
+	.sync_fs	= wrapfs_sync_fs,
 	.remount_fs	= wrapfs_remount_fs,
 	.evict_inode	= wrapfs_evict_inode,
 	.umount_begin	= wrapfs_umount_begin,
+	.show_options	= wrapfs_show_options,
+	.show_stats	= wrapfs_show_stats,
 	.alloc_inode	= wrapfs_alloc_inode,
-	.destroy_inode	= wrapfs_destroy_inode,
-	.drop_inode	= generic_delete_inode,
+	.free_inode	= wrapfs_free_inode,
+	.drop_inode	= wrapfs_drop_inode,
 };
 
 /* NFS support */
@@ -9,23 +9,33 @@
 #ifndef _WRAPFS_H_
 #define _WRAPFS_H_
 
+#include <linux/blkdev.h>
+#include <linux/compat.h>
 #include <linux/dcache.h>
 #include <linux/exportfs.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/fs_stack.h>
+#include <linux/ktime.h>
 #include <linux/magic.h>
 #include <linux/mm.h>
 #include <linux/mount.h>
 #include <linux/namei.h>
+#include <linux/pagemap.h>
+#include <linux/parser.h>
+#include <linux/refcount.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
 #include <linux/uaccess.h>
 #include <linux/user_namespace.h>
+#include <linux/workqueue.h>
 #include <linux/xattr.h>
 
+#include "wrapfs_ioctl.h"
+
 /* the file system name */
 #define WRAPFS_NAME "wrapfs"
 
@@ -42,17 +52,24 @@ extern const struct inode_operations wrapfs_main_iops;
 extern const struct inode_operations wrapfs_dir_iops;
 extern const struct inode_operations wrapfs_symlink_iops;
 extern const struct super_operations wrapfs_sops;
-extern const struct dentry_operations wrapfs_dops;
+extern const struct dentry_operations wrapfs_dops, wrapfs_noreval_dops;
 extern const struct address_space_operations wrapfs_aops, wrapfs_dummy_aops;
-extern const struct vm_operations_struct wrapfs_vm_ops;
 extern const struct export_operations wrapfs_export_ops;
 extern const struct xattr_handler *wrapfs_xattr_handlers[];
 
+struct wrapfs_sb_info;
+
+extern int wrapfs_parse_options(struct wrapfs_sb_info *sbi, char *options);
+extern void wrapfs_inode_trim_work(struct work_struct *work);
 extern int wrapfs_init_inode_cache(void);
 extern void wrapfs_destroy_inode_cache(void);
 extern int wrapfs_init_dentry_cache(void);
 extern void wrapfs_destroy_dentry_cache(void);
+extern int wrapfs_init_aio_cache(void);
+extern void wrapfs_destroy_aio_cache(void);
 extern int new_dentry_private_data(struct dentry *dentry);
+extern void wrapfs_set_d_op(struct dentry *dentry,
+                            struct dentry *lower_dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
 extern struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
                                     unsigned int flags);
@@ -60,30 +77,139 @@ extern struct inode *wrapfs_iget(struct super_block *sb,
                                  struct inode *lower_inode);
 extern int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
                             struct path *lower_path);
+extern ssize_t wrapfs_read_iter(struct kiocb *iocb, struct iov_iter *iter);
+extern ssize_t wrapfs_write_iter(struct kiocb *iocb, struct iov_iter *iter);
+extern void wrapfs_ra_done(struct file *file, loff_t pos, size_t count,
+                           u64 start_ns);
+extern void wrapfs_prefetch_open(struct file *file);
+extern void wrapfs_prefetch_hit(struct file *file, loff_t pos);
+extern void wrapfs_prefetch_release(struct file *file);
+extern long wrapfs_plan_ioctl(struct file *file, unsigned int cmd,
+                              unsigned long arg);
+extern void wrapfs_plan_destroy(struct super_block *sb);
+extern long wrapfs_pin_ioctl(struct file *file, unsigned int cmd,
+                             unsigned long arg);
+extern void wrapfs_pin_get_status(struct super_block *sb,
+                                  struct wrapfs_pin_status *status);
+extern void wrapfs_pin_destroy(struct super_block *sb);
+extern void wrapfs_put_link(void *arg);
+extern void wrapfs_pin_recharge_work(struct work_struct *work);
+extern int wrapfs_fill_cache(struct file *lower_file, loff_t pos, loff_t len);
+extern loff_t wrapfs_wait_cache(struct address_space *mapping, loff_t pos,
+                                loff_t len, const bool *cancel);
+extern ssize_t wrapfs_wb_write(struct kiocb *iocb, struct iov_iter *iter);
+extern int __wrapfs_wb_sync(struct inode *inode, bool nowait, bool free);
+extern void wrapfs_wb_sync_sb(struct super_block *sb);
+extern void wrapfs_wb_evict(struct inode *inode);
+extern void wrapfs_wb_open(struct file *file);
+extern void wrapfs_wb_release(struct file *file);
+
+/* per open file sequential readahead state (readahead.c) */
+struct wrapfs_ra_state {
+    loff_t next;      /* where a sequential reader continues */
+    loff_t issued;    /* lower readahead was requested up to here */
+    u64 stream_start; /* ns, start of the current sequential stream */
+    u64 stream_bytes; /* bytes read in the current stream */
+    u64 lat_ns;       /* decaying peak of the lower read latency */
+};
+
+/* per open file whole-file prefetch accounting (readahead.c) */
+struct wrapfs_pf_state {
+    loff_t len;   /* bytes prefetched at open, 0 if none */
+    loff_t seen;  /* end of the furthest read since */
+    bool checked; /* the first read looked for a hit */
+};
+
+/* write-behind buffer of an inode (writebehind.c) */
+struct wrapfs_wbuf {
+    struct mutex lock;       /* protects everything below */
+    loff_t pos;              /* file offset of data[0] */
+    size_t len;              /* bytes buffered */
+    bool append;             /* buffered O_APPEND writes */
+    char *data;              /* wb_max bytes while in use */
+    struct file *lower_file; /* where the buffered data goes */
+};
+
+/*
+ * Cached body of a symlink (inode.c).  The body never changes; the lower
+ * ctime it is valid for lives in the inode, so that a changed ctime with
+ * the same target only updates that stamp.  A superseded body is freed
+ * after an RCU grace period once the last path walk dropped it.
+ */
+struct wrapfs_link {
+    refcount_t ref; /* the inode's, and one per path walk using it */
+    struct rcu_head rcu;
+    char body[];
+};
 
 /* file private data */
 struct wrapfs_file_info {
     struct file *lower_file;
-    const struct vm_operations_struct *lower_vm_ops;
+    struct wrapfs_ra_state ra;
+    struct wrapfs_pf_state pf;
 };
 
 /* wrapfs inode data in memory */
 struct wrapfs_inode_info {
     struct inode *lower_inode;
+    unsigned long flags;
+    struct wrapfs_wbuf *wbuf; /* allocated on first buffered write */
+    atomic_t readers;         /* open files with FMODE_READ */
+    struct wrapfs_link __rcu *link; /* symlinks: cached body, if read */
+    struct timespec64 link_ctime;   /* of the lower inode, for link */
+    seqcount_spinlock_t link_seq;   /* link and link_ctime, i_lock */
     struct inode vfs_inode;
 };
 
+/* wrapfs_inode_info.flags bits */
+#define WRAPFS_I_ATTR_STALE 0 /* lazy_attr: times not copied up yet */
+
 /* wrapfs dentry data in memory */
 struct wrapfs_dentry_info {
-    spinlock_t lock; /* protects lower_path */
+    /* read on every operation, written only while setting up/tearing down */
+    seqcount_spinlock_t seq; /* lets readers of lower_path go lockless */
     struct path lower_path;
+    spinlock_t lock;     /* serializes lower_path writers */
+    struct rcu_head rcu; /* RCU-walk may still look at us after d_release */
 };
 
+struct wrapfs_plan;
+
 /* wrapfs super-block data in memory */
 struct wrapfs_sb_info {
     struct super_block *lower_sb;
+    unsigned int mount_opt;
+    unsigned long ra_min; /* readahead window bounds in bytes, */
+    unsigned long ra_max; /* ra_max == 0 disables wrapfs readahead */
+    unsigned long wb_max;   /* write-behind buffer size, 0 disables */
+    unsigned long wb_limit; /* bound on all write-behind buffers */
+    atomic_long_t wb_bytes; /* write-behind buffer memory in use */
+    loff_t pf_max;          /* whole-file prefetch up to this size */
+    atomic64_t pf_files;    /* files prefetched on open */
+    atomic64_t pf_hits;     /* ... whose first read found data cached */
+    atomic64_t pf_wasted;   /* bytes prefetched but never read */
+    struct mutex plan_lock; /* protects plan */
+    struct wrapfs_plan *plan; /* last access plan started (plan.c) */
+    loff_t pin_max;          /* pinned residency budget, 0 disables */
+    struct mutex pin_lock;   /* protects pins and pin_bytes */
+    struct list_head pins;   /* pinned residency set (pin.c) */
+    loff_t pin_bytes;        /* charged against pin_max */
+    struct work_struct pin_work; /* re-checks the charges of pins */
+    unsigned long inode_cache; /* unused inodes kept on the LRU, 0 for none */
+    struct work_struct inode_trim; /* trims the LRU down to inode_cache */
+    struct super_block *sb;        /* back pointer, for inode_trim */
 };
 
+/* mount options (wrapfs_sb_info.mount_opt) */
+#define WRAPFS_MOUNT_LAZY_ATTR 0x0002    /* defer attr copies off the I/O path */
+
+/* default lower bound of the readahead window (ra_min_kb) */
+#define WRAPFS_RA_MIN_DEFAULT (128UL << 10)
+/* default bound on all write-behind buffers of a mount (wb_limit_kb) */
+#define WRAPFS_WB_LIMIT_DEFAULT (16UL << 20)
+
+#define wrapfs_test_opt(sb, opt) (WRAPFS_SB(sb)->mount_opt & WRAPFS_MOUNT_##opt)
+
 /*
  * inode to private data
  *
@@ -122,6 +248,116 @@ static inline void wrapfs_set_lower_inode(struct inode *i, struct inode *val) {
     WRAPFS_I(i)->lower_inode = val;
 }
 
+/*
+ * Attribute propagation after a read or write.  In lazy_attr mode the
+ * times are not copied on every I/O: the inode is only marked stale (a
+ * plain read once the bit is set) and wrapfs_refresh_attr picks the times
+ * up from getattr, setattr, fsync, llseek and release.  i_size is still
+ * copied eagerly, but only when it actually changed, because the VFS
+ * checks the upper i_size on its own (llseek, copy_file_range, ...).
+ */
+static inline void wrapfs_mark_attr_stale(struct inode *inode) {
+    if (!test_bit(WRAPFS_I_ATTR_STALE, &WRAPFS_I(inode)->flags))
+        set_bit(WRAPFS_I_ATTR_STALE, &WRAPFS_I(inode)->flags);
+}
+
+static inline void wrapfs_copy_attr_read(struct inode *inode,
+                                         struct inode *lower_inode) {
+    if (wrapfs_test_opt(inode->i_sb, LAZY_ATTR))
+        wrapfs_mark_attr_stale(inode);
+    else
+        fsstack_copy_attr_atime(inode, lower_inode);
+}
+
+/*
+ * The size or link count of a file may have changed.  If it is pinned (its
+ * lower mapping is unevictable), have pin.c re-check its pin; this can be
+ * called from I/O completion, so only queue the check.
+ */
+static inline void wrapfs_pin_note_change(struct inode *inode,
+                                        struct inode *lower_inode) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+
+    if (unlikely(mapping_unevictable(lower_inode->i_mapping)) && sbi->pin_max)
+        schedule_work(&sbi->pin_work);
+}
+
+static inline void wrapfs_copy_attr_write(struct inode *inode,
+                                          struct inode *lower_inode) {
+    wrapfs_pin_note_change(inode, lower_inode);
+    if (wrapfs_test_opt(inode->i_sb, LAZY_ATTR)) {
+        if (i_size_read(inode) != i_size_read(lower_inode))
+            fsstack_copy_inode_size(inode, lower_inode);
+        wrapfs_mark_attr_stale(inode);
+    } else {
+        fsstack_copy_inode_size(inode, lower_inode);
+        fsstack_copy_attr_times(inode, lower_inode);
+    }
+}
+
+static inline void wrapfs_refresh_attr(struct inode *inode) {
+    struct inode *lower_inode = wrapfs_lower_inode(inode);
+
+    if (!test_bit(WRAPFS_I_ATTR_STALE, &WRAPFS_I(inode)->flags) ||
+        !test_and_clear_bit(WRAPFS_I_ATTR_STALE, &WRAPFS_I(inode)->flags))
+        return;
+    fsstack_copy_inode_size(inode, lower_inode);
+    fsstack_copy_attr_times(inode, lower_inode);
+}
+
+/*
+ * Start timing a read for the readahead engine.  Returns 0 when there is
+ * nothing to track: engine disabled, a direct read that bypasses the
+ * page cache anyway, or a nowait read, which must not end up issuing the
+ * (blocking) readahead.
+ */
+static inline u64 wrapfs_ra_begin(const struct kiocb *iocb) {
+    if (!WRAPFS_SB(file_inode(iocb->ki_filp)->i_sb)->ra_max ||
+        (iocb->ki_flags & (IOCB_DIRECT | IOCB_NOWAIT)))
+        return 0;
+    return ktime_get_ns();
+}
+
+/*
+ * Whole-file prefetch accounting around a read at @pos of a file that was
+ * prefetched on open: the first read checks for a hit, and every read
+ * records how far the file has been consumed.
+ */
+static inline void wrapfs_prefetch_begin(struct file *file, loff_t pos) {
+    struct wrapfs_pf_state *pf = &WRAPFS_F(file)->pf;
+
+    if (unlikely(pf->len && !pf->checked))
+        wrapfs_prefetch_hit(file, pos);
+}
+
+static inline void wrapfs_prefetch_end(struct file *file, loff_t end) {
+    struct wrapfs_pf_state *pf = &WRAPFS_F(file)->pf;
+
+    if (unlikely(pf->len) && end > pf->seen)
+        pf->seen = end;
+}
+
+/*
+ * Flush write-behind data of @inode to the lower file before anything
+ * that has to see it (reads, seeks, stat, truncate, ...).
+ */
+static inline int wrapfs_wb_sync(struct inode *inode, bool nowait) {
+    struct wrapfs_wbuf *wb = READ_ONCE(WRAPFS_I(inode)->wbuf);
+
+    if (!wb || !READ_ONCE(wb->len))
+        return 0;
+    return __wrapfs_wb_sync(inode, nowait, false);
+}
+
+/* flush and also give the buffer memory back (fsync, close, release) */
+static inline int wrapfs_wb_drain(struct inode *inode) {
+    struct wrapfs_wbuf *wb = READ_ONCE(WRAPFS_I(inode)->wbuf);
+
+    if (!wb || (!READ_ONCE(wb->len) && !READ_ONCE(wb->data)))
+        return 0;
+    return __wrapfs_wb_sync(inode, false, true);
+}
+
 /* superblock to lower superblock */
 static inline struct super_block *
 wrapfs_lower_super(const struct super_block *sb) {
@@ -138,41 +374,54 @@ static inline void pathcpy(struct path *dst, const struct path *src) {
     dst->dentry = src->dentry;
     dst->mnt = src->mnt;
 }
-/* Returns struct path.  Caller must path_put it. */
+/*
+ * Returns struct path, borrowed from @dent: a dentry holds references to
+ * its lower path from interpose to d_release, so the path stays valid for
+ * as long as the caller holds @dent, and neither a lock nor a path_get is
+ * needed.  The seqcount only keeps readers from seeing a half-written
+ * path.  Callers that keep the path beyond that must path_get it.
+ */
 static inline void wrapfs_get_lower_path(const struct dentry *dent,
                                          struct path *lower_path) {
-    spin_lock(&WRAPFS_D(dent)->lock);
-    pathcpy(lower_path, &WRAPFS_D(dent)->lower_path);
-    path_get(lower_path);
-    spin_unlock(&WRAPFS_D(dent)->lock);
-    return;
+    struct wrapfs_dentry_info *info = WRAPFS_D(dent);
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&info->seq);
+        pathcpy(lower_path, &info->lower_path);
+    } while (read_seqcount_retry(&info->seq, seq));
 }
+/* nothing to drop for a borrowed path, kept for symmetry */
 static inline void wrapfs_put_lower_path(const struct dentry *dent,
                                          struct path *lower_path) {
-    path_put(lower_path);
     return;
 }
+/* update lower_path for lockless readers (and for RCU-walk's READ_ONCE) */
+static inline void __wrapfs_publish_lower_path(struct wrapfs_dentry_info *info,
+                                               struct dentry *dentry,
+                                               struct vfsmount *mnt) {
+    spin_lock(&info->lock);
+    write_seqcount_begin(&info->seq);
+    WRITE_ONCE(info->lower_path.dentry, dentry);
+    WRITE_ONCE(info->lower_path.mnt, mnt);
+    write_seqcount_end(&info->seq);
+    spin_unlock(&info->lock);
+}
 static inline void wrapfs_set_lower_path(const struct dentry *dent,
                                          struct path *lower_path) {
-    spin_lock(&WRAPFS_D(dent)->lock);
-    pathcpy(&WRAPFS_D(dent)->lower_path, lower_path);
-    spin_unlock(&WRAPFS_D(dent)->lock);
+    __wrapfs_publish_lower_path(WRAPFS_D(dent), lower_path->dentry,
+                                lower_path->mnt);
     return;
 }
 static inline void wrapfs_reset_lower_path(const struct dentry *dent) {
-    spin_lock(&WRAPFS_D(dent)->lock);
-    WRAPFS_D(dent)->lower_path.dentry = NULL;
-    WRAPFS_D(dent)->lower_path.mnt = NULL;
-    spin_unlock(&WRAPFS_D(dent)->lock);
+    __wrapfs_publish_lower_path(WRAPFS_D(dent), NULL, NULL);
     return;
 }
 static inline void wrapfs_put_reset_lower_path(const struct dentry *dent) {
     struct path lower_path;
-    spin_lock(&WRAPFS_D(dent)->lock);
+
     pathcpy(&lower_path, &WRAPFS_D(dent)->lower_path);
-    WRAPFS_D(dent)->lower_path.dentry = NULL;
-    WRAPFS_D(dent)->lower_path.mnt = NULL;
-    spin_unlock(&WRAPFS_D(dent)->lock);
+    __wrapfs_publish_lower_path(WRAPFS_D(dent), NULL, NULL);
     path_put(&lower_path);
     return;
 }
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+/*
+ * Copyright (c) 1998-2020 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2020 Stony Brook University
+ * Copyright (c) 2003-2020 The Research Foundation of SUNY
+ */
+
+#ifndef _WRAPFS_IOCTL_H_
+#define _WRAPFS_IOCTL_H_
+
+/*
+ * wrapfs specific ioctls.  They can be issued on any file or directory of
+ * a wrapfs mount; all other ioctls are passed to the lower file.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define WRAPFS_IOC_MAGIC 0xb5
+
+/* one file range of an access plan */
+struct wrapfs_plan_entry {
+    __u64 path;   /* NUL-terminated path, relative to the mount root */
+    __u64 offset; /* first byte to prefetch */
+    __u64 length; /* bytes to prefetch, 0 up to the end of the file */
+};
+
+/* WRAPFS_IOC_PLAN_START argument */
+struct wrapfs_plan_args {
+    __u64 entries;    /* array of struct wrapfs_plan_entry, in read order */
+    __u32 nr_entries; /* at most WRAPFS_PLAN_MAX_ENTRIES */
+    __u32 depth;      /* entries in flight, 0 for the default */
+};
+
+#define WRAPFS_PLAN_MAX_ENTRIES 65536
+#define WRAPFS_PLAN_MAX_PATH_BYTES (4 << 20) /* all paths of a plan */
+#define WRAPFS_PLAN_MAX_DEPTH 256
+#define WRAPFS_PLAN_DEFAULT_DEPTH 16
+
+/* wrapfs_plan_status.state */
+#define WRAPFS_PLAN_NONE 0      /* no plan was started on this mount */
+#define WRAPFS_PLAN_RUNNING 1
+#define WRAPFS_PLAN_DONE 2
+#define WRAPFS_PLAN_CANCELLED 3
+
+/* WRAPFS_IOC_PLAN_STATUS result, for the last plan started */
+struct wrapfs_plan_status {
+    __u32 state;      /* WRAPFS_PLAN_* */
+    __u32 nr_entries; /* entries in the plan */
+    __u32 done;       /* entries completed, failed or skipped by a cancel */
+    __u32 errors;     /* entries that could not be opened or read ahead */
+    __u64 bytes;      /* bytes found up to date in the page cache */
+};
+
+#define WRAPFS_IOC_PLAN_START _IOW(WRAPFS_IOC_MAGIC, 1, struct wrapfs_plan_args)
+#define WRAPFS_IOC_PLAN_STATUS                                                 \
+    _IOR(WRAPFS_IOC_MAGIC, 2, struct wrapfs_plan_status)
+#define WRAPFS_IOC_PLAN_CANCEL _IO(WRAPFS_IOC_MAGIC, 3)
+
+/* WRAPFS_IOC_PIN_STATUS result */
+struct wrapfs_pin_status {
+    __u64 budget;   /* pin_max_kb of the mount, in bytes */
+    __u64 pinned;   /* bytes charged against the budget */
+    __u64 resident; /* bytes of pinned files in the page cache */
+    __u32 nr_files; /* files in the pin set */
+    __u32 __pad;
+};
+
+/* pin/unpin the file the ioctl is issued on; needs CAP_IPC_LOCK */
+#define WRAPFS_IOC_PIN _IO(WRAPFS_IOC_MAGIC, 4)
+#define WRAPFS_IOC_UNPIN _IO(WRAPFS_IOC_MAGIC, 5)
+#define WRAPFS_IOC_PIN_STATUS                                                  \
+    _IOR(WRAPFS_IOC_MAGIC, 6, struct wrapfs_pin_status)
+
+#endif /* not _WRAPFS_IOCTL_H_ */
@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 1998-2020 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2020 Stony Brook University
+ * Copyright (c) 2003-2020 The Research Foundation of SUNY
+ */
+
+#include "wrapfs.h"
+#include <linux/sched/signal.h>
+
+/*
+ * Write-behind buffering for small sequential writes.
+ *
+ * With the wb_max_kb mount option, small synchronous buffered writes are
+ * copied into a per-inode buffer as long as they extend the buffered range
+ * contiguously, and the buffer goes to the lower file as one large write.
+ * This keeps loggers issuing 100-byte writes from hitting NFS/FUSE lowers
+ * with tiny requests.
+ *
+ * The buffer belongs to the inode, not to the open file, so every wrapfs
+ * read, seek, stat, truncate, ... of the inode flushes it first and sees
+ * the data, whichever file descriptor wrote it.  Memory is bounded by the
+ * wb_limit_kb mount option: when the mount-wide total is reached, writes
+ * simply go through.  Buffers are flushed and freed on fsync, close and
+ * release.  A failed flush is recorded on the lower mapping, so the next
+ * fsync reports it like any other writeback error.
+ *
+ * Nothing is buffered while the inode is open for reading anywhere (an
+ * O_RDWR file counts) or mapped: opening for reading flushes the buffer,
+ * so ->mmap, which runs under mmap_lock and must not write to the lower
+ * file, never has anything to flush.  Writes that would run into
+ * RLIMIT_FSIZE or the lower s_maxbytes go through, so that EFBIG and
+ * SIGXFSZ reach the writer and not whoever flushes later.
+ */
+
+/* write the buffered range to the lower file; called with wb->lock held */
+static int __wrapfs_wb_flush(struct inode *inode, struct wrapfs_wbuf *wb) {
+    int err = 0;
+    ssize_t ret;
+    size_t done = 0;
+    loff_t pos = wb->pos;
+    struct file *lower_file = wb->lower_file;
+
+    if (!wb->len)
+        return 0;
+
+    while (done < wb->len) {
+        ret = kernel_write(lower_file, wb->data + done, wb->len - done, &pos);
+        if (ret <= 0) {
+            err = ret ? ret : -EIO;
+            mapping_set_error(lower_file->f_mapping, err);
+            break;
+        }
+        done += ret;
+    }
+
+    wrapfs_copy_attr_write(inode, file_inode(lower_file));
+    wb->len = 0;
+    wb->lower_file = NULL;
+    fput(lower_file);
+    return err;
+}
+
+static void wrapfs_wb_free_data(struct super_block *sb,
+                                struct wrapfs_wbuf *wb) {
+    if (!wb->data)
+        return;
+    kvfree(wb->data);
+    wb->data = NULL;
+    atomic_long_sub(WRAPFS_SB(sb)->wb_max, &WRAPFS_SB(sb)->wb_bytes);
+}
+
+/*
+ * Make sure buffered data of @inode is in the lower file, and with @free
+ * give the buffer memory back too.  With @nowait the caller must not
+ * block, so pending data means -EAGAIN.
+ */
+int __wrapfs_wb_sync(struct inode *inode, bool nowait, bool free) {
+    int err;
+    struct wrapfs_wbuf *wb = WRAPFS_I(inode)->wbuf;
+
+    if (nowait) {
+        if (!mutex_trylock(&wb->lock))
+            return -EAGAIN;
+        if (wb->len) {
+            mutex_unlock(&wb->lock);
+            return -EAGAIN;
+        }
+    } else {
+        mutex_lock(&wb->lock);
+    }
+
+    err = __wrapfs_wb_flush(inode, wb);
+    if (free)
+        wrapfs_wb_free_data(inode->i_sb, wb);
+    mutex_unlock(&wb->lock);
+    return err;
+}
+
+static struct wrapfs_wbuf *wrapfs_wb_get(struct inode *inode) {
+    struct wrapfs_wbuf *wb = READ_ONCE(WRAPFS_I(inode)->wbuf);
+
+    if (wb)
+        return wb;
+
+    wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+    if (!wb)
+        return NULL;
+    mutex_init(&wb->lock);
+    if (cmpxchg(&WRAPFS_I(inode)->wbuf, NULL, wb)) {
+        kfree(wb);
+        wb = WRAPFS_I(inode)->wbuf;
+    }
+    return wb;
+}
+
+/* can this write be absorbed into the write-behind buffer at all? */
+static bool wrapfs_wb_eligible(struct kiocb *iocb, struct iov_iter *iter,
+                               struct file *lower_file) {
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(file_inode(iocb->ki_filp)->i_sb);
+
+    if (!is_sync_kiocb(iocb) ||
+        (iocb->ki_flags & (IOCB_DIRECT | IOCB_DSYNC | IOCB_NOWAIT)))
+        return false;
+    /*
+     * Appends are only buffered when the lower file appends as well, so
+     * that the flush lands at the then current end of file no matter who
+     * else appended in between.
+     */
+    if ((iocb->ki_flags & IOCB_APPEND) && !(lower_file->f_flags & O_APPEND))
+        return false;
+    /* readers and mappings see the lower page cache, not our buffer */
+    if (atomic_read(&WRAPFS_I(file_inode(iocb->ki_filp))->readers) ||
+        mapping_mapped(lower_file->f_mapping))
+        return false;
+    return iov_iter_count(iter) <= sbi->wb_max / 2;
+}
+
+/* would the lower file refuse (part of) this write? */
+static bool wrapfs_wb_over_limit(struct kiocb *iocb, struct file *lower_file,
+                                 struct wrapfs_wbuf *wb, size_t count) {
+    struct inode *lower_inode = file_inode(lower_file);
+    unsigned long limit = rlimit(RLIMIT_FSIZE);
+    loff_t pos = iocb->ki_pos;
+
+    if (iocb->ki_flags & IOCB_APPEND)
+        pos = i_size_read(lower_inode) + wb->len;
+    if (limit != RLIM_INFINITY && pos + count > limit)
+        return true;
+    return pos + count > lower_inode->i_sb->s_maxbytes;
+}
+
+/*
+ * Called for every write while write-behind is enabled.  Returns the
+ * number of bytes absorbed into the buffer, 0 if the caller has to write
+ * to the lower file itself (any buffered data was flushed first, so the
+ * writes reach the lower file in order), or a negative error.
+ */
+ssize_t wrapfs_wb_write(struct kiocb *iocb, struct iov_iter *iter) {
+    ssize_t err = 0;
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+    struct file *lower_file = wrapfs_lower_file(file);
+    size_t count = iov_iter_count(iter), copied;
+    bool append = iocb->ki_flags & IOCB_APPEND;
+    struct wrapfs_wbuf *wb;
+
+    if (!wrapfs_wb_eligible(iocb, iter, lower_file))
+        return wrapfs_wb_sync(inode, iocb->ki_flags & IOCB_NOWAIT);
+
+    wb = wrapfs_wb_get(inode);
+    if (!wb)
+        return 0;
+
+    mutex_lock(&wb->lock);
+    /* not contiguous with, or does not fit into, what is buffered */
+    if (wb->len &&
+        (wb->lower_file != lower_file || wb->append != append ||
+         wb->len + count > sbi->wb_max ||
+         (!append && iocb->ki_pos != wb->pos + wb->len))) {
+        err = __wrapfs_wb_flush(inode, wb);
+        if (err)
+            goto out;
+    }
+    /* a reader may have opened the file since the unlocked check */
+    if (atomic_read(&WRAPFS_I(inode)->readers) ||
+        wrapfs_wb_over_limit(iocb, lower_file, wb, count)) {
+        err = __wrapfs_wb_flush(inode, wb);
+        goto out;
+    }
+
+    if (!wb->data) {
+        /* stay within the mount-wide budget, or just write through */
+        if (atomic_long_add_return(sbi->wb_max, &sbi->wb_bytes) >
+            sbi->wb_limit) {
+            atomic_long_sub(sbi->wb_max, &sbi->wb_bytes);
+            goto out;
+        }
+        wb->data = kvmalloc(sbi->wb_max, GFP_KERNEL);
+        if (!wb->data) {
+            atomic_long_sub(sbi->wb_max, &sbi->wb_bytes);
+            goto out;
+        }
+    }
+
+    copied = copy_from_iter(wb->data + wb->len, count, iter);
+    if (!copied) {
+        err = -EFAULT;
+        goto out;
+    }
+    if (!wb->len) {
+        wb->pos = iocb->ki_pos;
+        wb->append = append;
+        wb->lower_file = get_file(lower_file);
+    }
+    wb->len += copied;
+    /* an append ends up at EOF when flushed: report where that is now */
+    if (append)
+        iocb->ki_pos = i_size_read(file_inode(lower_file)) + wb->len;
+    else
+        iocb->ki_pos += copied;
+    err = copied;
+out:
+    mutex_unlock(&wb->lock);
+    return err;
+}
+
+/* sync(2) and syncfs(2): flush the write-behind buffers of all inodes */
+void wrapfs_wb_sync_sb(struct super_block *sb) {
+    struct inode *inode, *toput = NULL;
+
+    if (!WRAPFS_SB(sb)->wb_max)
+        return;
+
+    spin_lock(&sb->s_inode_list_lock);
+    list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+        if (!READ_ONCE(WRAPFS_I(inode)->wbuf) || !igrab(inode))
+            continue;
+        spin_unlock(&sb->s_inode_list_lock);
+
+        wrapfs_wb_sync(inode, false);
+        /* the list stays valid past this inode while we hold it */
+        iput(toput);
+        toput = inode;
+
+        cond_resched();
+        spin_lock(&sb->s_inode_list_lock);
+    }
+    spin_unlock(&sb->s_inode_list_lock);
+    iput(toput);
+}
+
+/*
+ * A file was opened: from now on writes to the inode go through while it
+ * is open for reading.  wrapfs_wb_write checks readers under wb->lock, so
+ * nothing is buffered any more once this flush took the lock.
+ */
+void wrapfs_wb_open(struct file *file) {
+    struct inode *inode = file_inode(file);
+
+    if (!(file->f_mode & FMODE_READ))
+        return;
+    atomic_inc(&WRAPFS_I(inode)->readers);
+    /* pairs with the cmpxchg in wrapfs_wb_get */
+    smp_mb__after_atomic();
+    /*
+     * Take the lock even if nothing seems buffered, a writer may be in
+     * the middle of adding to the buffer.  A failed flush is recorded on
+     * the lower mapping for fsync.
+     */
+    if (READ_ONCE(WRAPFS_I(inode)->wbuf))
+        __wrapfs_wb_sync(inode, false, false);
+}
+
+void wrapfs_wb_release(struct file *file) {
+    if (file->f_mode & FMODE_READ)
+        atomic_dec(&WRAPFS_I(file_inode(file))->readers);
+}
+
+/* the inode is going away: all files were released, so just free */
+void wrapfs_wb_evict(struct inode *inode) {
+    struct wrapfs_wbuf *wb = WRAPFS_I(inode)->wbuf;
+
+    if (!wb)
+        return;
+    WARN_ON(wb->len);
+    wrapfs_wb_free_data(inode->i_sb, wb);
+    WRAPFS_I(inode)->wbuf = NULL;
+    kfree(wb);
+}